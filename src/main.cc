@@ -5,24 +5,47 @@
 // Copyright (c) 2024 Volker Schwaberow
 
 #include <algorithm>
+#include <array>
 #include <atomic>
+#include <bit>
+#include <charconv>
 #include <chrono>
+#include <condition_variable>
+#include <cmath>
+#include <cstdint>
 #include <ctime>
 #include <cstring>
+#include <deque>
 #include <fcntl.h>
+#include <sys/resource.h>
 #include <filesystem>
 #include <fstream>
 #include <iostream>
+#include <limits>
 #include <string>
+#include <thread>
 #include <unistd.h>
 #include <unordered_set>
 #include <vector>
 #include <sstream>
 #include <unordered_map>
 #include <memory_resource>
+#include <mutex>
+#include <numeric>
+#include <optional>
+#include <random>
 
 #include <CLI/CLI.hpp>
 
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#endif
+
 inline constexpr const char *PROGRAM_NAME = PROJECT_NAME;
 inline constexpr const char *PROGRAM_VERSION = PROJECT_VERSION;
 inline constexpr const char *PROGRAM_AUTHOR = PROJECT_AUTHOR;
@@ -34,6 +57,72 @@ inline constexpr const char *COMPILER_INFO = COMPILER_INFO_STRING;
 
 namespace fs = std::filesystem;
 
+// Characters to strip from one end of a word: single bytes via a table, multi-byte UTF-8 code points
+// (e.g. Unicode punctuation) as sequences.
+struct TrimSet
+{
+  std::array<bool, 256> bytes{};
+  std::vector<std::string> sequences;
+  bool any = false;
+
+  bool empty() const { return !any; }
+};
+
+// Why a word was dropped before reaching the word store.
+enum RejectReason
+{
+  kRejectNone,
+  kRejectEmpty, // nothing left after trimming
+  kRejectMinLength,
+  kRejectMaxLength,
+  kRejectNumeric,  // --no-numbers
+  kRejectHash,     // --hash-remove
+  kRejectDupSense, // --dup-sense
+  kRejectJunk,     // --junk-remove
+  kRejectEntropy,  // --min-entropy
+  kRejectClasses,  // --min-classes
+  kRejectScript,   // another script's output
+  kRejectCount
+};
+
+inline constexpr std::array<const char *, kRejectCount> REJECT_NAMES = {"none", "empty-after-trim", "minlen", "maxlen",
+                                                                        "numeric", "hash", "dup-sense", "junk", "entropy",
+                                                                        "classes", "script"};
+
+// The writing system of a word's letters. Digits, punctuation and symbols are common to all scripts
+// and do not count; a word with letters from more than one script is mixed.
+enum Script
+{
+  kScriptCommon, // no letters at all
+  kScriptLatin,
+  kScriptGreek,
+  kScriptCyrillic,
+  kScriptHebrew,
+  kScriptArabic,
+  kScriptCjk, // Han, kana and Hangul
+  kScriptOther,
+  kScriptMixed,
+  kScriptCount
+};
+
+inline constexpr std::array<const char *, kScriptCount> SCRIPT_NAMES = {
+    "common", "latin", "greek", "cyrillic", "hebrew", "arabic", "cjk", "other", "mixed"};
+
+class RejectLog;
+struct Options;
+struct WordState;
+
+// One compiled step of the word pipeline.
+struct PipelineStage
+{
+  using Function = bool (*)(WordState &word, const PipelineStage &stage, const Options &options); // false drops the word
+
+  Function run = nullptr;
+  int number = 0;        // maxtrim length or dup-sense percentage
+  bool modifies = false; // may change the word's bytes
+  bool shrinks = false;  // may drop bytes other than by maxtrim
+};
+
 struct Options
 {
   int maxlen = 0;
@@ -43,12 +132,23 @@ struct Options
   bool dup_remove = false;
   bool no_sentence = false;
   bool lower = false;
+  bool unleet = false;
+  bool leet_dedup = false;
+  std::size_t leet_variants = 0;
   bool wordify = false;
   bool no_numbers = false;
   int minlen = 0;
   bool detab = false;
   int dup_sense = 0;
   bool hash_remove = false;
+  bool junk_remove = false;
+  bool junk_tag = false;
+  double min_entropy = 0.0;
+  std::uint64_t entropy_threshold = 0; // min_entropy in fixed point, set by compile_pipeline
+  int prefilter_maxtrim = 0;           // shortest maxtrim of the pipeline, set by compile_pipeline
+  int min_classes = 0;
+  bool sort_score = false;
+  std::optional<Script> script; // keep only words of this script
   bool email_sort = false;
   std::string email_split;
   std::string email_split_user;
@@ -57,6 +157,486 @@ struct Options
   bool noutf8 = false;
   bool sort = false;
   bool deduplicate = false;
+  bool binary_out = false;
+  bool binary_hashes = false;
+  bool binary_counts = false;
+  std::string trim_chars;
+  std::string ltrim_chars;
+  std::string rtrim_chars;
+  TrimSet left_trim;
+  TrimSet right_trim;
+  double sample = 1.0;
+  std::uint64_t sample_threshold = std::numeric_limits<std::uint64_t>::max();
+  std::size_t reservoir = 0;
+  std::string engine = "auto";
+  bool explain = false;
+  bool hash_first = false;
+  std::size_t threads = 0; // picked by plan_run unless --threads is given
+  fs::path provenance;
+  fs::path stats;
+  bool perf_counters = false;
+  fs::path trace;
+  fs::path metrics_file;
+  double metrics_interval = 10;
+  fs::path reject_log_path;
+  std::size_t reject_sample = 1;
+  RejectLog *reject_log = nullptr; // opened from reject_log_path
+  std::string pipeline_spec;
+  std::vector<PipelineStage> pipeline; // compiled from pipeline_spec or the transform flags
+};
+
+// Binary block format used to chain runs without re-splitting text.
+//
+//   header: "\x89WLS" | u16 version | u16 flags
+//   block:  u32 word_count | u32 payload_bytes | u64 checksum | payload
+//   payload: u32 offsets[word_count + 1] | data (padded to 8 bytes)
+//            | u64 hashes[word_count] (kBinaryHashes)
+//            | u32 counts[word_count] (kBinaryCounts)
+//
+// All integers are little-endian and the checksum covers the payload. The magic starts with a byte
+// that no ASCII or UTF-8 text starts with, so a text wordlist is never mistaken for binary input.
+inline constexpr char BINARY_MAGIC[4] = {'\x89', 'W', 'L', 'S'};
+inline constexpr std::uint16_t BINARY_VERSION = 1;
+inline constexpr std::size_t BINARY_HEADER_SIZE = 8;
+inline constexpr std::size_t BINARY_BLOCK_HEADER_SIZE = 16;
+inline constexpr std::size_t BINARY_BLOCK_WORDS = 65536;
+inline constexpr std::size_t BINARY_BLOCK_BYTES = 1 << 20;
+
+enum BinaryFlags : std::uint16_t
+{
+  kBinarySorted = 1 << 0,
+  kBinaryDeduplicated = 1 << 1,
+  kBinaryHashes = 1 << 2,
+  kBinaryCounts = 1 << 3,
+};
+
+template <typename T>
+T load_le(const char *p)
+{
+  T value;
+  std::memcpy(&value, p, sizeof(T));
+  return value;
+}
+
+template <typename T>
+void store_le(std::string &out, T value)
+{
+  out.append(reinterpret_cast<const char *>(&value), sizeof(T));
+}
+
+// wyhash-style 64-bit hash, shared by the binary hash column and block checksums.
+inline std::uint64_t hash_mix(std::uint64_t a, std::uint64_t b)
+{
+  __uint128_t r = static_cast<__uint128_t>(a) * b;
+  return static_cast<std::uint64_t>(r) ^ static_cast<std::uint64_t>(r >> 64);
+}
+
+std::uint64_t hash_bytes(const char *p, std::size_t n, std::uint64_t seed = 0)
+{
+  constexpr std::uint64_t P0 = 0xa0761d6478bd642full;
+  constexpr std::uint64_t P1 = 0xe7037ed1a0b428dbull;
+  seed ^= P0;
+  std::uint64_t a = 0;
+  std::uint64_t b = 0;
+  if (n <= 16)
+  {
+    if (n >= 4)
+    {
+      std::size_t mid = (n >> 3) << 2;
+      a = (static_cast<std::uint64_t>(load_le<std::uint32_t>(p)) << 32) | load_le<std::uint32_t>(p + mid);
+      b = (static_cast<std::uint64_t>(load_le<std::uint32_t>(p + n - 4)) << 32) | load_le<std::uint32_t>(p + n - 4 - mid);
+    }
+    else if (n > 0)
+    {
+      a = (static_cast<std::uint64_t>(static_cast<unsigned char>(p[0])) << 16) |
+          (static_cast<std::uint64_t>(static_cast<unsigned char>(p[n >> 1])) << 8) |
+          static_cast<unsigned char>(p[n - 1]);
+    }
+  }
+  else
+  {
+    std::size_t i = n;
+    while (i > 16)
+    {
+      seed = hash_mix(load_le<std::uint64_t>(p) ^ P1, load_le<std::uint64_t>(p + 8) ^ seed);
+      p += 16;
+      i -= 16;
+    }
+    a = load_le<std::uint64_t>(p + i - 16);
+    b = load_le<std::uint64_t>(p + i - 8);
+  }
+  return hash_mix(P1 ^ n, hash_mix(a ^ P1, b ^ seed));
+}
+
+inline std::uint64_t hash_word(std::string_view word)
+{
+  return hash_bytes(word.data(), word.size());
+}
+
+// Uniform reservoir over the stream of kept words (Algorithm L). Most words are dropped by comparing
+// a counter, without drawing a random number. The seed is fixed so previews are reproducible.
+class Reservoir
+{
+public:
+  static constexpr std::size_t npos = std::numeric_limits<std::size_t>::max();
+
+  Reservoir(std::size_t capacity, std::uint64_t seed) : capacity_(capacity), rng_(0x5eed ^ seed)
+  {
+    weight_ = std::exp(std::log(Random()) / static_cast<double>(capacity_));
+    next_ = capacity_;
+    Skip();
+  }
+
+  // Slot for the next word: `capacity` or more means append, npos means drop.
+  std::size_t Offer()
+  {
+    ++seen_;
+    if (seen_ <= capacity_)
+    {
+      return capacity_;
+    }
+    if (seen_ != next_)
+    {
+      return npos;
+    }
+    weight_ *= std::exp(std::log(Random()) / static_cast<double>(capacity_));
+    Skip();
+    return static_cast<std::size_t>(rng_() % capacity_);
+  }
+
+  std::uint64_t Seen() const { return seen_; }
+
+private:
+  double Random()
+  {
+    // (0, 1]: log() of the draw must stay finite.
+    return (static_cast<double>(rng_() >> 11) + 1.0) * 0x1.0p-53;
+  }
+
+  void Skip()
+  {
+    next_ += static_cast<std::uint64_t>(std::floor(std::log(Random()) / std::log1p(-weight_))) + 1;
+  }
+
+  std::size_t capacity_;
+  std::uint64_t seen_ = 0;
+  std::uint64_t next_ = 0;
+  double weight_ = 0;
+  std::mt19937_64 rng_;
+};
+
+// Where a word came from, packed as file id (high 16 bits) and byte offset of its line (low 48 bits).
+inline constexpr int ORIGIN_OFFSET_BITS = 48;
+inline constexpr std::size_t MAX_ORIGIN_FILES = std::size_t{1} << (64 - ORIGIN_OFFSET_BITS);
+
+inline std::uint64_t make_origin(std::size_t file_id, std::size_t offset)
+{
+  return static_cast<std::uint64_t>(file_id) << ORIGIN_OFFSET_BITS | offset;
+}
+
+// Kept words plus the columns computed for them once in the processing stage.
+struct WordList
+{
+  std::vector<std::string> words;
+  std::vector<std::uint64_t> hashes;  // parallel to `words` when `hashed` is set
+  std::vector<std::uint64_t> origins; // parallel to `words` when `tracked` is set
+  std::vector<std::uint32_t> weights; // parallel to `words` when `weighted` is set: occurrences per word
+  bool hashed = false;
+  bool tracked = false;
+  bool weighted = false;
+  std::optional<Reservoir> reservoir;
+};
+
+bool needs_hashes(const Options &options)
+{
+  return options.deduplicate || (options.binary_out && options.binary_hashes);
+}
+
+// Occurrence counts are only written for deduplicated binary output; counted binary inputs then add
+// their stored counts instead of one per word.
+bool needs_weights(const Options &options)
+{
+  return options.deduplicate && options.binary_out && options.binary_counts;
+}
+
+inline std::uint32_t word_weight(const WordList &list, std::size_t index)
+{
+  return list.weighted ? list.weights[index] : 1;
+}
+
+// Order produced while reading: when `sorted` is set, `order` holds sorted runs ending at `ends`.
+struct SortedRuns
+{
+  std::vector<std::size_t> order;
+  std::vector<std::size_t> ends;
+  bool sorted = false;
+  std::string engine = "merge"; // how the runs were produced, when there is only one
+};
+
+inline constexpr std::size_t HISTOGRAM_BUCKETS = 65; // lengths 0..63, then 64 and longer
+
+enum PerfEvent
+{
+  kPerfCycles,
+  kPerfInstructions,
+  kPerfLlcMisses,
+  kPerfBranchMisses,
+  kPerfEventCount
+};
+
+inline constexpr std::array<const char *, kPerfEventCount> PERF_EVENT_NAMES = {"cycles", "instructions", "llc_misses",
+                                                                               "branch_misses"};
+
+// Hardware counter deltas over one pipeline stage; -1 marks a counter the kernel would not open.
+struct StageCounters
+{
+  std::string stage;
+  std::array<std::int64_t, kPerfEventCount> values{};
+};
+
+// Memory figures for the summary line and --stats, in bytes unless noted.
+struct MemoryStats
+{
+  std::uint64_t peak_rss = 0;
+  std::uint64_t word_store = 0;       // word columns plus the heap buffers of long words
+  std::uint64_t word_allocations = 0; // words too long for the in-place small-string buffer
+  std::uint64_t arena = 0;            // hash deduplication arena, zero when it did not run
+  std::uint64_t arena_allocations = 0;
+  double table_load = 0;
+};
+
+// Counters collected while reading, reported with --stats.
+struct Stats
+{
+  std::uint64_t bytes_read = 0;
+  std::uint64_t lines = 0;
+  std::uint64_t prefiltered = 0; // lines rejected on their raw length before any processing
+  std::array<std::uint64_t, HISTOGRAM_BUCKETS> line_lengths{};
+  std::array<std::uint64_t, kRejectCount> rejected{}; // prefiltered lines count under their length reason
+  std::string sort_engine = "none";
+  std::optional<std::vector<StageCounters>> perf_stages; // set by --perf-counters, empty when unavailable
+  MemoryStats memory;
+
+  void Add(const Stats &other)
+  {
+    bytes_read += other.bytes_read;
+    lines += other.lines;
+    prefiltered += other.prefiltered;
+    for (size_t i = 0; i < line_lengths.size(); ++i)
+    {
+      line_lengths[i] += other.line_lengths[i];
+    }
+    for (size_t i = 0; i < rejected.size(); ++i)
+    {
+      rejected[i] += other.rejected[i];
+    }
+  }
+};
+
+// Hardware counters for this process and every thread it starts later, read between pipeline stages
+// for --perf-counters. Each event is opened on its own so a missing one (LLC misses are often absent
+// in VMs) does not take the others down. Create() returns nullptr when none can be opened, which is
+// the normal case in containers and under a strict perf_event_paranoid.
+class PerfCounters
+{
+public:
+  static std::unique_ptr<PerfCounters> Create()
+  {
+    std::unique_ptr<PerfCounters> counters(new PerfCounters());
+    bool any = false;
+#ifdef __linux__
+    constexpr std::array<std::uint64_t, kPerfEventCount> events = {PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+                                                                   PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES};
+    for (size_t i = 0; i < events.size(); ++i)
+    {
+      perf_event_attr attr{};
+      attr.size = sizeof(attr);
+      attr.type = PERF_TYPE_HARDWARE;
+      attr.config = events[i];
+      attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+      attr.inherit = 1;
+      attr.exclude_kernel = 1;
+      attr.exclude_hv = 1;
+      counters->fds_[i] = static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC));
+      any = any || counters->fds_[i] != -1;
+    }
+#endif
+    if (!any)
+    {
+      return nullptr;
+    }
+    counters->last_ = counters->Read();
+    return counters;
+  }
+
+  ~PerfCounters()
+  {
+    for (int fd : fds_)
+    {
+      if (fd != -1)
+      {
+        close(fd);
+      }
+    }
+  }
+
+  // Returns the counts since the previous lap, or since Create() for the first one.
+  StageCounters Lap(const char *stage)
+  {
+    auto now = Read();
+    StageCounters counters{stage, {}};
+    for (size_t i = 0; i < now.size(); ++i)
+    {
+      counters.values[i] = now[i] < 0 ? -1 : now[i] - last_[i];
+    }
+    last_ = now;
+    return counters;
+  }
+
+private:
+  PerfCounters() { fds_.fill(-1); }
+
+  // Reads every counter, scaled up for the time it was multiplexed off the PMU.
+  std::array<std::int64_t, kPerfEventCount> Read() const
+  {
+    std::array<std::int64_t, kPerfEventCount> values;
+    values.fill(-1);
+    for (size_t i = 0; i < fds_.size(); ++i)
+    {
+      std::uint64_t data[3]; // value, time enabled, time running
+      if (fds_[i] != -1 && read(fds_[i], data, sizeof(data)) == static_cast<ssize_t>(sizeof(data)))
+      {
+        values[i] = data[2] > 0 ? static_cast<std::int64_t>(static_cast<double>(data[0]) * data[1] / data[2]) : 0;
+      }
+    }
+    return values;
+  }
+
+  std::array<int, kPerfEventCount> fds_;
+  std::array<std::int64_t, kPerfEventCount> last_{};
+};
+
+inline constexpr std::size_t TRACE_RING_EVENTS = 1 << 16; // per thread; older spans are overwritten
+
+// Spans recorded for --trace. Every thread appends to its own ring buffer, so recording a span takes
+// no lock; the registry lock is only taken the first time a thread records. Write() must run after
+// the recording threads have been joined.
+class Trace
+{
+public:
+  using Clock = std::chrono::steady_clock;
+
+  static void Start()
+  {
+    origin_ = Clock::now();
+    enabled_ = true;
+    LocalRing(); // the main thread gets the first track
+  }
+
+  static bool Enabled() { return enabled_; }
+
+  static void Record(const char *name, Clock::time_point begin, Clock::time_point end)
+  {
+    auto &ring = LocalRing();
+    auto micros = [](Clock::duration duration)
+    { return std::chrono::duration_cast<std::chrono::microseconds>(duration).count(); };
+    Event event{name, micros(begin - origin_), micros(end - begin)};
+    if (ring.events.size() < TRACE_RING_EVENTS)
+    {
+      ring.events.push_back(event);
+    }
+    else
+    {
+      ring.events[ring.recorded % TRACE_RING_EVENTS] = event;
+    }
+    ++ring.recorded;
+  }
+
+  // Writes every ring as Chrome trace-event JSON, which Perfetto and chrome://tracing load directly.
+  static bool Write(const fs::path &path)
+  {
+    std::ofstream file(path);
+    if (!file)
+    {
+      std::cerr << "Error: Failed to open trace file: " << path << std::endl;
+      return false;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    file << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n";
+    bool first = true;
+    for (size_t t = 0; t < rings_.size(); ++t)
+    {
+      const auto &ring = *rings_[t];
+      file << (first ? "" : ",\n") << "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": " << t + 1
+           << ", \"args\": {\"name\": \"" << (t == 0 ? "main" : "worker " + std::to_string(t)) << "\"}}";
+      first = false;
+      for (const auto &event : ring.events)
+      {
+        file << ",\n{\"name\": \"" << event.name << "\", \"ph\": \"X\", \"pid\": 1, \"tid\": " << t + 1
+             << ", \"ts\": " << event.begin << ", \"dur\": " << event.duration << "}";
+      }
+      if (ring.recorded > ring.events.size())
+      {
+        std::cerr << "Warning: Trace ring of thread " << t + 1 << " overflowed, " << ring.recorded - ring.events.size()
+                  << " early spans were dropped" << std::endl;
+      }
+    }
+    file << "\n]}\n";
+    return !file.fail();
+  }
+
+private:
+  struct Event
+  {
+    const char *name;
+    std::int64_t begin;
+    std::int64_t duration;
+  };
+
+  struct Ring
+  {
+    std::vector<Event> events;
+    std::size_t recorded = 0;
+  };
+
+  static Ring &LocalRing()
+  {
+    thread_local Ring *ring = nullptr;
+    if (!ring)
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      ring = rings_.emplace_back(std::make_unique<Ring>()).get();
+    }
+    return *ring;
+  }
+
+  static inline bool enabled_ = false;
+  static inline Clock::time_point origin_;
+  static inline std::mutex mutex_;
+  static inline std::vector<std::unique_ptr<Ring>> rings_;
+};
+
+// Records the enclosing scope as one span of `name` (a string literal) when tracing is on.
+class TraceSpan
+{
+public:
+  explicit TraceSpan(const char *name) : name_(name), begin_(Trace::Enabled() ? Trace::Clock::now() : Trace::Clock::time_point{}) {}
+
+  ~TraceSpan()
+  {
+    if (Trace::Enabled())
+    {
+      Trace::Record(name_, begin_, Trace::Clock::now());
+    }
+  }
+
+  TraceSpan(const TraceSpan &) = delete;
+  TraceSpan &operator=(const TraceSpan &) = delete;
+
+private:
+  const char *name_;
+  Trace::Clock::time_point begin_;
 };
 
 class FileDescriptor
@@ -155,333 +735,3439 @@ private:
   std::unique_ptr<MemoryMapping> mapping_;
 };
 
-std::string strip_html_tags(const std::string &html)
+enum CharClass : std::uint8_t
 {
-  std::string result;
-  bool in_tag = false;
+  kClassDigit = 1 << 0,
+  kClassAlpha = 1 << 1,
+  kClassHex = 1 << 2,
+  kClassSpecial = 1 << 3, // anything that is not alphanumeric
+  kClassSpace = 1 << 4,
+  kClassHtml = 1 << 5,
+  kClassUpper = 1 << 6,
+};
 
-  for (char c : html)
+constexpr std::array<std::uint8_t, 256> make_char_classes()
+{
+  std::array<std::uint8_t, 256> table{};
+  for (int c = 0; c < 256; ++c)
   {
-    if (c == '<')
-    {
-      in_tag = true;
-    }
-    else if (c == '>')
-    {
-      in_tag = false;
-    }
-    else if (!in_tag)
-    {
-      result += c;
-    }
+    std::uint8_t mask = 0;
+    bool upper = c >= 'A' && c <= 'Z';
+    bool alpha = upper || (c >= 'a' && c <= 'z');
+    bool digit = c >= '0' && c <= '9';
+    mask |= digit ? kClassDigit : 0;
+    mask |= alpha ? kClassAlpha : 0;
+    mask |= upper ? kClassUpper : 0;
+    mask |= digit || (c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F') ? kClassHex : 0;
+    mask |= !alpha && !digit ? kClassSpecial : 0;
+    mask |= c == ' ' || c == '\t' ? kClassSpace : 0;
+    mask |= c == '<' || c == '>' ? kClassHtml : 0;
+    table[c] = mask;
   }
-
-  return result;
-}
-
-bool is_digit(char c)
-{
-  return c >= '0' && c <= '9';
-}
-
-bool is_alpha(char c)
-{
-  return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+  return table;
 }
 
-bool is_alnum(char c)
-{
-  return is_alpha(c) || is_digit(c);
-}
+inline constexpr std::array<std::uint8_t, 256> CHAR_CLASSES = make_char_classes();
 
-std::string trim_digits(const std::string &str)
+constexpr std::array<char, 256> make_lower_map()
 {
-  size_t start = 0;
-  size_t end = str.length();
-
-  while (start < end && is_digit(str[start]))
+  std::array<char, 256> table{};
+  for (int c = 0; c < 256; ++c)
   {
-    ++start;
+    table[c] = static_cast<char>(CHAR_CLASSES[c] & kClassUpper ? c + ('a' - 'A') : c);
   }
+  return table;
+}
 
-  while (end > start && is_digit(str[end - 1]))
-  {
-    --end;
-  }
+inline constexpr std::array<char, 256> LOWER_MAP = make_lower_map();
 
-  return str.substr(start, end - start);
-}
+// Leet spellings and the letters they stand for. Only one-byte substitutions are used, so mapping a
+// word never changes its length.
+inline constexpr std::array<std::pair<char, const char *>, 6> LEET_SUBSTITUTIONS = {{
+    {'a', "4@"}, {'e', "3"}, {'i', "1"}, {'o', "0"}, {'s', "5$"}, {'t', "7"}}};
 
-std::string trim_special(const std::string &str)
+constexpr std::array<char, 256> make_leet_map()
 {
-  size_t start = 0;
-  size_t end = str.length();
-
-  while (start < end && !is_alnum(str[start]))
+  std::array<char, 256> table{};
+  for (int c = 0; c < 256; ++c)
   {
-    ++start;
+    table[c] = static_cast<char>(c);
   }
-
-  while (end > start && !is_alnum(str[end - 1]))
+  for (const auto &[letter, spellings] : LEET_SUBSTITUTIONS)
   {
-    --end;
+    for (const char *s = spellings; *s; ++s)
+    {
+      table[static_cast<unsigned char>(*s)] = letter;
+    }
   }
-
-  return str.substr(start, end - start);
+  return table;
 }
 
-bool is_valid_email(const std::string &str)
+inline constexpr std::array<char, 256> LEET_MAP = make_leet_map();
+
+constexpr std::array<const char *, 256> make_leet_spellings()
 {
-  size_t at_pos = str.find('@');
-  if (at_pos == std::string::npos || at_pos == 0 || at_pos == str.length() - 1)
+  std::array<const char *, 256> table{};
+  for (const auto &[letter, spellings] : LEET_SUBSTITUTIONS)
   {
-    return false;
+    table[static_cast<unsigned char>(letter)] = spellings;
+    table[static_cast<unsigned char>(letter - ('a' - 'A'))] = spellings;
   }
-
-  size_t dot_pos = str.find('.', at_pos);
-  return dot_pos != std::string::npos && dot_pos > at_pos + 1 && dot_pos < str.length() - 1;
+  return table;
 }
 
-std::pair<std::string, std::string> split_email(const std::string &email)
+inline constexpr std::array<const char *, 256> LEET_SPELLINGS = make_leet_spellings();
+
+inline bool has_class(char c, std::uint8_t mask)
 {
-  size_t at_pos = email.find('@');
-  return {email.substr(0, at_pos), email.substr(at_pos + 1)};
+  return (CHAR_CLASSES[static_cast<unsigned char>(c)] & mask) != 0;
 }
 
-std::string process_word(const std::string &word, const Options &options)
+bool is_digit(char c)
 {
-  std::string processed = word;
+  return has_class(c, kClassDigit);
+}
+
+bool is_alpha(char c)
+{
+  return has_class(c, kClassAlpha);
+}
+
+bool is_alnum(char c)
+{
+  return has_class(c, kClassDigit | kClassAlpha);
+}
+
+// Low/high nibble tables for classifying 32 bytes at a time with pshufb: a byte is in the class when
+// lo[byte & 15] & hi[byte >> 4] is non-zero. Each distinct set of low nibbles gets its own bit.
+struct NibbleTable
+{
+  std::array<std::uint8_t, 16> lo{};
+  std::array<std::uint8_t, 16> hi{};
+};
+
+constexpr NibbleTable make_nibble_table(std::uint8_t mask)
+{
+  NibbleTable table;
+  std::array<std::uint16_t, 8> sets{};
+  int used = 0;
+  for (int h = 0; h < 16; ++h)
+  {
+    std::uint16_t set = 0;
+    for (int l = 0; l < 16; ++l)
+    {
+      set |= CHAR_CLASSES[h << 4 | l] & mask ? 1 << l : 0;
+    }
+    if (set == 0)
+    {
+      continue;
+    }
+    int bit = 0;
+    while (bit < used && sets[bit] != set)
+    {
+      ++bit;
+    }
+    if (bit == used)
+    {
+      if (used == 8)
+      {
+        throw "character class needs more than 8 nibble sets";
+      }
+      sets[used++] = set;
+    }
+    table.hi[h] = static_cast<std::uint8_t>(1 << bit);
+    for (int l = 0; l < 16; ++l)
+    {
+      table.lo[l] |= set & (1 << l) ? 1 << bit : 0;
+    }
+  }
+  return table;
+}
+
+// True when every byte of `word` belongs to `Mask`.
+template <std::uint8_t Mask>
+bool all_in_class(std::string_view word)
+{
+  std::size_t i = 0;
+#ifdef __AVX2__
+  static constexpr NibbleTable table = make_nibble_table(Mask);
+  const __m256i lo_table = _mm256_broadcastsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i *>(table.lo.data())));
+  const __m256i hi_table = _mm256_broadcastsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i *>(table.hi.data())));
+  const __m256i low_nibble = _mm256_set1_epi8(0x0f);
+  for (; i + 32 <= word.size(); i += 32)
+  {
+    __m256i bytes = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(word.data() + i));
+    __m256i lo = _mm256_shuffle_epi8(lo_table, _mm256_and_si256(bytes, low_nibble));
+    __m256i hi = _mm256_shuffle_epi8(hi_table, _mm256_and_si256(_mm256_srli_epi16(bytes, 4), low_nibble));
+    __m256i miss = _mm256_cmpeq_epi8(_mm256_and_si256(lo, hi), _mm256_setzero_si256());
+    if (_mm256_movemask_epi8(miss) != 0)
+    {
+      return false;
+    }
+  }
+#endif
+  for (; i < word.size(); ++i)
+  {
+    if (!has_class(word[i], Mask))
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Patterns of machine-made or lazy words recognised by classify_junk.
+enum JunkKind
+{
+  kJunkNone,
+  kJunkRepeat, // one chunk over and over: aaaaaa, 123123123, qwertyqwerty
+  kJunkRun,    // bytes counting up or down: abcdef, 987654
+  kJunkWalk,   // neighbouring keys on a QWERTY keyboard: asdfgh, zaq12wsx
+  kJunkCount
+};
+
+inline constexpr std::array<const char *, kJunkCount> JUNK_NAMES = {"none", "repeat", "run", "walk"};
+
+// Shorter words are too often real words that happen to match (abcd is still junk, "were" is a walk).
+inline constexpr std::size_t JUNK_MIN_LENGTH = 4;
+inline constexpr std::size_t JUNK_WALK_MIN_LENGTH = 6;
+
+inline constexpr std::array<std::string_view, 4> KEYBOARD_ROWS = {"1234567890-=", "qwertyuiop[]", "asdfghjkl;'",
+                                                                  "zxcvbnm,./"};
+
+// One 256-bit set per byte of the keys next to it. Each row sits half a key right of the row above,
+// so key c of a row touches keys c-1 and c of the row below.
+constexpr std::array<std::array<std::uint64_t, 4>, 256> make_key_neighbours()
+{
+  std::array<std::array<std::uint64_t, 4>, 256> table{};
+  auto link = [&table](char a, char b)
+  {
+    auto x = static_cast<unsigned char>(a);
+    auto y = static_cast<unsigned char>(b);
+    table[x][y / 64] |= std::uint64_t{1} << (y % 64);
+    table[y][x / 64] |= std::uint64_t{1} << (x % 64);
+  };
+  for (size_t row = 0; row < KEYBOARD_ROWS.size(); ++row)
+  {
+    auto keys = KEYBOARD_ROWS[row];
+    for (size_t col = 0; col < keys.size(); ++col)
+    {
+      if (col + 1 < keys.size())
+      {
+        link(keys[col], keys[col + 1]);
+      }
+      if (row + 1 == KEYBOARD_ROWS.size())
+      {
+        continue;
+      }
+      auto below = KEYBOARD_ROWS[row + 1];
+      if (col > 0 && col - 1 < below.size())
+      {
+        link(keys[col], below[col - 1]);
+      }
+      if (col < below.size())
+      {
+        link(keys[col], below[col]);
+      }
+    }
+  }
+  return table;
+}
+
+inline constexpr std::array<std::array<std::uint64_t, 4>, 256> KEY_NEIGHBOURS = make_key_neighbours();
+
+inline constexpr std::size_t KEYBOARD_KEYS = []
+{
+  std::size_t keys = 0;
+  for (auto row : KEYBOARD_ROWS)
+  {
+    keys += row.size();
+  }
+  return keys;
+}();
+
+// Classifies a word as a repetition, a run or a keyboard walk, whole word only. Runs and walks share
+// one pass over the bytes; the prefix function behind the repetition check only runs when the first
+// byte comes back within the first half, which rules out most real words with one memchr. For a
+// repetition, `period` receives the length of the repeated chunk.
+JunkKind classify_junk(std::string_view word, std::size_t *period = nullptr)
+{
+  size_t n = word.size();
+  if (n < JUNK_MIN_LENGTH)
+  {
+    return kJunkNone;
+  }
+
+  if (std::memchr(word.data() + 1, word[0], n / 2) != nullptr)
+  {
+    // border[i] is the longest proper prefix of word[0..i] that is also its suffix; the word repeats
+    // a chunk of n - border[n-1] bytes, which has to fit at least twice.
+    thread_local std::vector<std::uint32_t> border;
+    border.resize(n);
+    border[0] = 0;
+    for (size_t i = 1; i < n; ++i)
+    {
+      std::uint32_t k = border[i - 1];
+      while (k > 0 && word[i] != word[k])
+      {
+        k = border[k - 1];
+      }
+      border[i] = k + (word[i] == word[k]);
+    }
+    if (2 * (n - border[n - 1]) <= n)
+    {
+      if (period)
+      {
+        *period = n - border[n - 1];
+      }
+      return kJunkRepeat;
+    }
+  }
+
+  int step = static_cast<unsigned char>(word[1]) - static_cast<unsigned char>(word[0]);
+  bool run = step == 1 || step == -1;
+  bool walk = n >= JUNK_WALK_MIN_LENGTH;
+  for (size_t i = 1; i < n && (run || walk); ++i)
+  {
+    auto previous = static_cast<unsigned char>(word[i - 1]);
+    auto current = static_cast<unsigned char>(word[i]);
+    run &= current - previous == step;
+    auto key = static_cast<unsigned char>(LOWER_MAP[current]);
+    walk &= (KEY_NEIGHBOURS[static_cast<unsigned char>(LOWER_MAP[previous])][key / 64] >> (key % 64)) & 1;
+  }
+  return run ? kJunkRun : walk ? kJunkWalk : kJunkNone;
+}
+
+// Scores are fixed point with 16 fractional bits, so filters and the score sort compare integers.
+inline constexpr int SCORE_SHIFT = 16;
+inline constexpr std::size_t SCORE_TABLE_SIZE = 256;
+
+// Character classes counted by the scorer; bytes outside ASCII letters and digits are all "other".
+enum ScoreClass : std::uint8_t
+{
+  kScoreLower = 1 << 0,
+  kScoreUpper = 1 << 1,
+  kScoreDigit = 1 << 2,
+  kScoreOther = 1 << 3,
+};
+
+// How many symbols a brute-force guesser has to try per byte of each class, in ScoreClass bit order.
+inline constexpr std::array<std::uint32_t, 4> SCORE_CLASS_SIZES = {26, 26, 10, 33};
+
+constexpr std::array<std::uint8_t, 256> make_score_classes()
+{
+  std::array<std::uint8_t, 256> table{};
+  for (int c = 0; c < 256; ++c)
+  {
+    auto mask = CHAR_CLASSES[c];
+    table[c] = mask & kClassUpper   ? kScoreUpper
+               : mask & kClassAlpha ? kScoreLower
+               : mask & kClassDigit ? kScoreDigit
+                                    : kScoreOther;
+  }
+  return table;
+}
+
+inline constexpr std::array<std::uint8_t, 256> SCORE_CLASSES = make_score_classes();
+
+// log2(n) and n*log2(n) for small n, in fixed point. Shannon entropy only needs these per byte count.
+struct ScoreTables
+{
+  std::array<std::uint64_t, SCORE_TABLE_SIZE + 1> log2;
+  std::array<std::uint64_t, SCORE_TABLE_SIZE + 1> count_log2;
+};
+
+inline const ScoreTables SCORE_TABLES = []
+{
+  ScoreTables tables{};
+  for (std::size_t n = 1; n <= SCORE_TABLE_SIZE; ++n)
+  {
+    tables.log2[n] = std::llround(std::ldexp(std::log2(static_cast<double>(n)), SCORE_SHIFT));
+    tables.count_log2[n] = std::llround(std::ldexp(n * std::log2(static_cast<double>(n)), SCORE_SHIFT));
+  }
+  return tables;
+}();
+
+inline std::uint64_t fixed_log2(std::size_t n)
+{
+  return n <= SCORE_TABLE_SIZE ? SCORE_TABLES.log2[n]
+                               : std::llround(std::ldexp(std::log2(static_cast<double>(n)), SCORE_SHIFT));
+}
+
+inline std::uint64_t fixed_count_log2(std::size_t n)
+{
+  return n <= SCORE_TABLE_SIZE ? SCORE_TABLES.count_log2[n] : n * fixed_log2(n);
+}
+
+// Shannon entropy of the whole word (length times bits per byte), as n*log2(n) - sum(c*log2(c)) over
+// the byte counts c. The histogram is cleared by reading it back through the word's own bytes, so a
+// word costs two passes over its bytes and no 256-entry reset.
+std::uint64_t word_entropy(std::string_view word)
+{
+  thread_local std::array<std::uint32_t, 256> counts{};
+  for (char c : word)
+  {
+    ++counts[static_cast<unsigned char>(c)];
+  }
+  std::uint64_t sum = 0;
+  for (char c : word)
+  {
+    auto &count = counts[static_cast<unsigned char>(c)];
+    sum += fixed_count_log2(count);
+    count = 0;
+  }
+  return fixed_count_log2(word.size()) - sum;
+}
+
+// The ScoreClass bits present in the word.
+std::uint8_t word_classes(std::string_view word)
+{
+  std::uint8_t mask = 0;
+  for (char c : word)
+  {
+    mask |= SCORE_CLASSES[static_cast<unsigned char>(c)];
+  }
+  return mask;
+}
+
+// Crude log2 of the guesses needed for the word, in the spirit of zxcvbn: brute force over the
+// classes it uses, unless it is junk that a pattern guesser finds sooner. A repetition costs its
+// chunk plus the repeat count, a run its first byte, direction and length, and a keyboard walk its
+// first key and then one of about four neighbours per key.
+std::uint64_t word_guesses(std::string_view word)
+{
+  auto mask = word_classes(word);
+  std::uint32_t cardinality = 0;
+  for (size_t i = 0; i < SCORE_CLASS_SIZES.size(); ++i)
+  {
+    cardinality += mask >> i & 1 ? SCORE_CLASS_SIZES[i] : 0;
+  }
+  std::uint64_t symbol = fixed_log2(cardinality);
+  std::uint64_t brute = word.size() * symbol;
+
+  std::size_t period = 0;
+  switch (classify_junk(word, &period))
+  {
+  case kJunkRepeat:
+    return std::min(brute, period * symbol + fixed_log2(word.size() / period));
+  case kJunkRun:
+    return std::min(brute, symbol + fixed_log2(2 * word.size()));
+  case kJunkWalk:
+    return std::min(brute, fixed_log2(KEYBOARD_KEYS) + (word.size() - 1) * fixed_log2(4));
+  default:
+    return brute;
+  }
+}
+
+struct ScriptRange
+{
+  char32_t first;
+  char32_t last;
+  Script script;
+};
+
+// Code-point blocks by script, sorted. Code points outside every block are letters of another script.
+inline constexpr std::array<ScriptRange, 32> SCRIPT_RANGES = {{
+    {0x0080, 0x00BF, kScriptCommon}, // Latin-1 punctuation and symbols
+    {0x00C0, 0x00D6, kScriptLatin},
+    {0x00D7, 0x00D7, kScriptCommon}, // multiplication sign
+    {0x00D8, 0x00F6, kScriptLatin},
+    {0x00F7, 0x00F7, kScriptCommon}, // division sign
+    {0x00F8, 0x02AF, kScriptLatin},  // rest of Latin-1 letters, Latin Extended-A and B, IPA
+    {0x02B0, 0x036F, kScriptCommon}, // modifier letters and combining marks
+    {0x0370, 0x03FF, kScriptGreek},
+    {0x0400, 0x052F, kScriptCyrillic},
+    {0x0590, 0x05FF, kScriptHebrew},
+    {0x0600, 0x065F, kScriptArabic},
+    {0x0660, 0x0669, kScriptCommon}, // Arabic-Indic digits
+    {0x066A, 0x06EF, kScriptArabic},
+    {0x06F0, 0x06F9, kScriptCommon}, // Extended Arabic-Indic digits
+    {0x06FA, 0x06FF, kScriptArabic},
+    {0x0750, 0x077F, kScriptArabic},
+    {0x08A0, 0x08FF, kScriptArabic},
+    {0x1E00, 0x1EFF, kScriptLatin},
+    {0x1F00, 0x1FFF, kScriptGreek},
+    {0x2000, 0x2BFF, kScriptCommon}, // punctuation, currency, arrows, maths, box drawing
+    {0x3000, 0x303F, kScriptCommon}, // CJK punctuation
+    {0x3040, 0x30FF, kScriptCjk},    // kana
+    {0x3400, 0x4DBF, kScriptCjk},
+    {0x4E00, 0x9FFF, kScriptCjk},
+    {0xAC00, 0xD7AF, kScriptCjk}, // Hangul syllables
+    {0xF900, 0xFAFF, kScriptCjk},
+    {0xFB1D, 0xFB4F, kScriptHebrew},
+    {0xFB50, 0xFDFF, kScriptArabic},
+    {0xFE70, 0xFEFF, kScriptArabic},
+    {0xFF00, 0xFFEF, kScriptCommon},   // fullwidth forms
+    {0x1F000, 0x1FAFF, kScriptCommon}, // emoji and pictographs
+    {0x20000, 0x3FFFF, kScriptCjk},
+}};
+
+// Length of the UTF-8 sequence a lead byte starts, or 0 for a byte that cannot start one.
+constexpr std::array<std::uint8_t, 256> make_utf8_lengths()
+{
+  std::array<std::uint8_t, 256> table{};
+  for (int c = 0; c < 256; ++c)
+  {
+    table[c] = c < 0x80 ? 1 : c >= 0xC2 && c < 0xE0 ? 2 : c >= 0xE0 && c < 0xF0 ? 3 : c >= 0xF0 && c < 0xF5 ? 4 : 0;
+  }
+  return table;
+}
+
+inline constexpr std::array<std::uint8_t, 256> UTF8_LENGTHS = make_utf8_lengths();
+
+// True when every byte is ASCII, 32 bytes at a time where AVX2 is available.
+bool is_ascii(std::string_view word)
+{
+  std::size_t i = 0;
+#ifdef __AVX2__
+  for (; i + 32 <= word.size(); i += 32)
+  {
+    if (_mm256_movemask_epi8(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(word.data() + i))) != 0)
+    {
+      return false;
+    }
+  }
+#endif
+  std::uint8_t high = 0;
+  for (; i < word.size(); ++i)
+  {
+    high |= static_cast<std::uint8_t>(word[i]);
+  }
+  return high < 0x80;
+}
+
+Script script_of(char32_t code_point)
+{
+  auto range = std::upper_bound(SCRIPT_RANGES.begin(), SCRIPT_RANGES.end(), code_point,
+                                [](char32_t value, const ScriptRange &candidate)
+                                { return value < candidate.first; });
+  if (range == SCRIPT_RANGES.begin() || code_point > std::prev(range)->last)
+  {
+    return kScriptOther;
+  }
+  return std::prev(range)->script;
+}
+
+// Classifies the letters of a word by code-point range. ASCII words, the common case, are settled by
+// one check of the high bits and one of the letter classes; invalid UTF-8 counts as other.
+Script classify_script(std::string_view word)
+{
+  if (is_ascii(word))
+  {
+    return std::any_of(word.begin(), word.end(), [](char c)
+                       { return has_class(c, kClassAlpha); })
+               ? kScriptLatin
+               : kScriptCommon;
+  }
+
+  Script found = kScriptCommon;
+  for (size_t i = 0; i < word.size();)
+  {
+    auto lead = static_cast<unsigned char>(word[i]);
+    std::size_t length = UTF8_LENGTHS[lead];
+    if (length == 0 || i + length > word.size())
+    {
+      return kScriptOther;
+    }
+    char32_t code_point = length == 1 ? lead : lead & (0x7F >> length);
+    for (size_t k = 1; k < length; ++k)
+    {
+      auto continuation = static_cast<unsigned char>(word[i + k]);
+      if ((continuation & 0xC0) != 0x80)
+      {
+        return kScriptOther;
+      }
+      code_point = code_point << 6 | (continuation & 0x3F);
+    }
+    i += length;
+
+    Script script = length == 1 ? (has_class(static_cast<char>(lead), kClassAlpha) ? kScriptLatin : kScriptCommon)
+                                : script_of(code_point);
+    if (script == kScriptCommon || script == found)
+    {
+      continue;
+    }
+    if (found != kScriptCommon)
+    {
+      return kScriptMixed;
+    }
+    found = script;
+  }
+  return found;
+}
+
+std::string strip_html_tags(std::string_view html)
+{
+  std::string result;
+  bool in_tag = false;
+
+  for (char c : html)
+  {
+    if (has_class(c, kClassHtml))
+    {
+      in_tag = c == '<';
+    }
+    else if (!in_tag)
+    {
+      result += c;
+    }
+  }
+
+  return result;
+}
+
+std::string_view trim_class(std::string_view str, std::uint8_t mask)
+{
+  size_t start = 0;
+  size_t end = str.length();
+
+  while (start < end && has_class(str[start], mask))
+  {
+    ++start;
+  }
+
+  while (end > start && has_class(str[end - 1], mask))
+  {
+    --end;
+  }
+
+  return str.substr(start, end - start);
+}
+
+std::string_view trim_digits(std::string_view str)
+{
+  return trim_class(str, kClassDigit);
+}
+
+std::string_view trim_special(std::string_view str)
+{
+  return trim_class(str, kClassSpecial);
+}
+
+TrimSet make_trim_set(std::string_view chars)
+{
+  TrimSet set;
+  for (size_t i = 0; i < chars.size();)
+  {
+    auto lead = static_cast<unsigned char>(chars[i]);
+    size_t length = lead < 0x80 ? 1 : lead >= 0xf0 ? 4 : lead >= 0xe0 ? 3 : lead >= 0xc0 ? 2 : 1;
+    length = std::min(length, chars.size() - i);
+    if (length == 1)
+    {
+      set.bytes[lead] = true;
+    }
+    else
+    {
+      set.sequences.emplace_back(chars.substr(i, length));
+    }
+    i += length;
+  }
+  set.any = !chars.empty();
+  return set;
+}
+
+// Length of the trim-set character at the front (or back) of `str`, or 0 if there is none.
+size_t trim_match(std::string_view str, const TrimSet &set, bool back)
+{
+  if (str.empty())
+  {
+    return 0;
+  }
+  if (set.bytes[static_cast<unsigned char>(back ? str.back() : str.front())])
+  {
+    return 1;
+  }
+  for (const auto &sequence : set.sequences)
+  {
+    if (back ? str.ends_with(sequence) : str.starts_with(sequence))
+    {
+      return sequence.size();
+    }
+  }
+  return 0;
+}
+
+std::string_view trim_set(std::string_view str, const TrimSet &left, const TrimSet &right)
+{
+  while (size_t n = trim_match(str, left, false))
+  {
+    str.remove_prefix(n);
+  }
+  while (size_t n = trim_match(str, right, true))
+  {
+    str.remove_suffix(n);
+  }
+  return str;
+}
+
+bool is_valid_email(std::string_view str)
+{
+  size_t at_pos = str.find('@');
+  if (at_pos == std::string::npos || at_pos == 0 || at_pos == str.length() - 1)
+  {
+    return false;
+  }
+
+  size_t dot_pos = str.find('.', at_pos);
+  return dot_pos != std::string::npos && dot_pos > at_pos + 1 && dot_pos < str.length() - 1;
+}
+
+std::pair<std::string_view, std::string_view> split_email(std::string_view email)
+{
+  size_t at_pos = email.find('@');
+  return {email.substr(0, at_pos), email.substr(at_pos + 1)};
+}
+
+// A word on its way through the pipeline: a view into the input until a stage has to change bytes,
+// then a view into `buffer`, which is copied into at most once.
+struct WordState
+{
+  std::string buffer;
+  std::string_view view;
+  bool owned = false;
+  RejectReason reason = kRejectNone;
+
+  std::string &Own()
+  {
+    if (owned)
+    {
+      size_t start = static_cast<size_t>(view.data() - buffer.data());
+      buffer.resize(start + view.size());
+      buffer.erase(0, start);
+    }
+    else
+    {
+      buffer.assign(view);
+      owned = true;
+    }
+    view = buffer;
+    return buffer;
+  }
+
+  void Replace(std::string word)
+  {
+    buffer = std::move(word);
+    owned = true;
+    view = buffer;
+  }
+
+  bool Reject(RejectReason why)
+  {
+    reason = why;
+    return false;
+  }
+};
+
+bool stage_dewebify(WordState &word, const PipelineStage &, const Options &)
+{
+  word.Replace(strip_html_tags(word.view));
+  return true;
+}
+
+bool stage_lower(WordState &word, const PipelineStage &, const Options &)
+{
+  auto &processed = word.Own();
+  std::transform(processed.begin(), processed.end(), processed.begin(),
+                 [](unsigned char c)
+                 { return LOWER_MAP[c]; });
+  return true;
+}
+
+bool stage_unleet(WordState &word, const PipelineStage &, const Options &)
+{
+  auto &processed = word.Own();
+  std::transform(processed.begin(), processed.end(), processed.begin(),
+                 [](unsigned char c)
+                 { return LEET_MAP[c]; });
+  return true;
+}
+
+bool stage_trim_digits(WordState &word, const PipelineStage &, const Options &)
+{
+  word.view = trim_digits(word.view);
+  return true;
+}
+
+bool stage_trim_special(WordState &word, const PipelineStage &, const Options &)
+{
+  word.view = trim_special(word.view);
+  return true;
+}
+
+bool stage_trim_chars(WordState &word, const PipelineStage &, const Options &options)
+{
+  word.view = trim_set(word.view, options.left_trim, options.right_trim);
+  return true;
+}
+
+bool stage_detab(WordState &word, const PipelineStage &, const Options &)
+{
+  auto first_non_space = std::find_if(word.view.begin(), word.view.end(), [](char c)
+                                      { return !has_class(c, kClassSpace); });
+  word.view.remove_prefix(static_cast<size_t>(first_non_space - word.view.begin()));
+  return true;
+}
+
+bool stage_maxtrim(WordState &word, const PipelineStage &stage, const Options &)
+{
+  if (word.view.length() > static_cast<size_t>(stage.number))
+  {
+    word.view = word.view.substr(0, stage.number);
+  }
+  return true;
+}
+
+bool stage_dup_remove(WordState &word, const PipelineStage &, const Options &)
+{
+  auto &processed = word.Own();
+  auto last = std::unique(processed.begin(), processed.end());
+  processed.erase(last, processed.end());
+  word.view = processed;
+  return true;
+}
+
+bool stage_filter_numeric(WordState &word, const PipelineStage &, const Options &)
+{
+  return !all_in_class<kClassDigit>(word.view) || word.Reject(kRejectNumeric);
+}
+
+bool stage_filter_hash(WordState &word, const PipelineStage &, const Options &)
+{
+  return word.view.length() < 32 || !all_in_class<kClassHex>(word.view) || word.Reject(kRejectHash);
+}
+
+bool stage_filter_junk(WordState &word, const PipelineStage &, const Options &)
+{
+  return classify_junk(word.view) == kJunkNone || word.Reject(kRejectJunk);
+}
+
+bool stage_filter_entropy(WordState &word, const PipelineStage &, const Options &options)
+{
+  return word_entropy(word.view) >= options.entropy_threshold * word.view.size() || word.Reject(kRejectEntropy);
+}
+
+bool stage_filter_classes(WordState &word, const PipelineStage &, const Options &options)
+{
+  return std::popcount(word_classes(word.view)) >= options.min_classes || word.Reject(kRejectClasses);
+}
+
+bool stage_filter_script(WordState &word, const PipelineStage &, const Options &options)
+{
+  return !options.script || classify_script(word.view) == *options.script || word.Reject(kRejectScript);
+}
+
+bool stage_filter_dup_sense(WordState &word, const PipelineStage &stage, const Options &)
+{
+  std::array<int, 256> char_count{};
+  for (char c : word.view)
+  {
+    char_count[static_cast<unsigned char>(c)]++;
+  }
+  for (int count : char_count)
+  {
+    if (static_cast<double>(count) / word.view.length() > stage.number / 100.0)
+    {
+      return word.Reject(kRejectDupSense);
+    }
+  }
+  return true;
+}
+
+bool stage_email(WordState &word, const PipelineStage &, const Options &)
+{
+  if (is_valid_email(word.view))
+  {
+    auto [username, domain] = split_email(word.view);
+    std::string result;
+    result.reserve(word.view.size());
+    result.append(username).append(" ").append(domain);
+    word.Replace(std::move(result));
+  }
+  return true;
+}
+
+struct StageDefinition
+{
+  const char *name;
+  PipelineStage::Function run;
+  bool numbered;
+  bool modifies;
+  bool shrinks;
+};
+
+inline constexpr std::array<StageDefinition, 17> STAGE_DEFINITIONS = {{
+    {"dewebify", stage_dewebify, false, true, true},
+    {"lower", stage_lower, false, true, false},
+    {"unleet", stage_unleet, false, true, false},
+    {"trim:digits", stage_trim_digits, false, true, true},
+    {"trim:special", stage_trim_special, false, true, true},
+    {"trim:chars", stage_trim_chars, false, true, true},
+    {"detab", stage_detab, false, true, true},
+    {"maxtrim", stage_maxtrim, true, true, false},
+    {"dup-remove", stage_dup_remove, false, true, true},
+    {"filter:numeric", stage_filter_numeric, false, false, false},
+    {"filter:hash", stage_filter_hash, false, false, false},
+    {"filter:dup-sense", stage_filter_dup_sense, true, false, false},
+    {"filter:junk", stage_filter_junk, false, false, false},
+    {"filter:entropy", stage_filter_entropy, false, false, false},
+    {"filter:classes", stage_filter_classes, false, false, false},
+    {"email", stage_email, false, true, false},
+    {"filter:script", stage_filter_script, false, false, false},
+}};
+
+PipelineStage make_stage(const StageDefinition &definition, int number = 0)
+{
+  return PipelineStage{definition.run, number, definition.modifies, definition.shrinks};
+}
+
+const StageDefinition &stage_definition(std::string_view name)
+{
+  return *std::find_if(STAGE_DEFINITIONS.begin(), STAGE_DEFINITIONS.end(), [name](const StageDefinition &definition)
+                       { return name == definition.name; });
+}
+
+// Builds options.pipeline, once per run: from --pipeline when given, otherwise from the transform
+// flags in their historical order. A --pipeline replaces the transform flags, and its shortest
+// maxtrim is what the raw length pre-filter trims to. --min-entropy is converted to fixed point here
+// too, so every target gets its own threshold. A target's script filter always comes last, so it is
+// not a stage a spec can name.
+bool compile_pipeline(Options &options)
+{
+  auto &pipeline = options.pipeline;
+  pipeline.clear();
+  options.prefilter_maxtrim = options.pipeline_spec.empty() ? options.maxtrim : 0;
+  options.entropy_threshold = static_cast<std::uint64_t>(std::llround(std::ldexp(options.min_entropy, SCORE_SHIFT)));
+  if (options.pipeline_spec.empty())
+  {
+    struct Flag
+    {
+      bool enabled;
+      const char *stage;
+      int number;
+    };
+    const std::array<Flag, 17> flags = {{
+        {options.dewebify, "dewebify", 0},
+        {options.lower, "lower", 0},
+        {options.unleet, "unleet", 0},
+        {options.digit_trim, "trim:digits", 0},
+        {options.special_trim, "trim:special", 0},
+        {!options.left_trim.empty() || !options.right_trim.empty(), "trim:chars", 0},
+        {options.detab, "detab", 0},
+        {options.maxtrim > 0, "maxtrim", options.maxtrim},
+        {options.dup_remove, "dup-remove", 0},
+        {options.no_numbers, "filter:numeric", 0},
+        {options.hash_remove, "filter:hash", 0},
+        {options.dup_sense > 0, "filter:dup-sense", options.dup_sense},
+        {options.junk_remove, "filter:junk", 0},
+        {options.min_entropy > 0, "filter:entropy", 0},
+        {options.min_classes > 0, "filter:classes", 0},
+        {options.email_sort, "email", 0},
+        {options.script.has_value(), "filter:script", 0},
+    }};
+    for (const auto &flag : flags)
+    {
+      if (flag.enabled)
+      {
+        pipeline.push_back(make_stage(stage_definition(flag.stage), flag.number));
+      }
+    }
+    return true;
+  }
+
+  std::string_view spec = options.pipeline_spec;
+  for (std::size_t start = 0; start <= spec.size();)
+  {
+    auto bar = std::min(spec.find('|', start), spec.size());
+    auto item = spec.substr(start, bar - start);
+    start = bar + 1;
+    if (item.empty())
+    {
+      std::cerr << "Error: Empty pipeline stage in --pipeline " << spec << std::endl;
+      return false;
+    }
+
+    auto definition = std::find_if(STAGE_DEFINITIONS.begin(), STAGE_DEFINITIONS.end(), [item](const StageDefinition &candidate)
+                                   {
+                                     std::string_view name = candidate.name;
+                                     return candidate.run != stage_filter_script && item.starts_with(name) &&
+                                            (item.size() == name.size() || (candidate.numbered && item[name.size()] == ':'));
+                                   });
+    int number = 0;
+    if (definition != STAGE_DEFINITIONS.end() && definition->numbered)
+    {
+      auto value = item.substr(std::min(item.size(), std::string_view(definition->name).size() + 1));
+      auto [end, error] = std::from_chars(value.data(), value.data() + value.size(), number);
+      if (error != std::errc{} || end != value.data() + value.size() || number <= 0)
+      {
+        definition = STAGE_DEFINITIONS.end();
+      }
+    }
+    if (definition == STAGE_DEFINITIONS.end())
+    {
+      std::cerr << "Error: Invalid pipeline stage '" << item << "' in --pipeline" << std::endl;
+      return false;
+    }
+    if (definition->run == stage_maxtrim)
+    {
+      options.prefilter_maxtrim = options.prefilter_maxtrim == 0 ? number : std::min(options.prefilter_maxtrim, number);
+    }
+    pipeline.push_back(make_stage(*definition, number));
+  }
+  if (options.script)
+  {
+    pipeline.push_back(make_stage(stage_definition("filter:script")));
+  }
+  return true;
+}
+
+// Runs one word through the compiled pipeline. A filtered word comes back empty, with the filter
+// stored in `reason` when one is passed.
+std::string process_word(std::string_view word, const Options &options, RejectReason *reason = nullptr)
+{
+  WordState state;
+  state.view = word;
+  for (const auto &stage : options.pipeline)
+  {
+    if (!stage.run(state, stage, options))
+    {
+      if (reason)
+      {
+        *reason = state.reason;
+      }
+      return "";
+    }
+  }
+  if (state.owned)
+  {
+    return std::move(state.Own());
+  }
+  return std::string(state.view);
+}
+
+// Compact sort key: the first 8 bytes in big-endian order, so integer comparison matches byte order.
+// Most comparisons resolve on the inline prefix; only ties look at the strings.
+struct SortRecord
+{
+  std::uint64_t prefix;
+  std::uint32_t length;
+  std::uint32_t index;
+};
+
+inline std::uint64_t key_prefix(std::string_view word)
+{
+  char bytes[8] = {};
+  std::memcpy(bytes, word.data(), std::min<std::size_t>(sizeof(bytes), word.size()));
+  return __builtin_bswap64(load_le<std::uint64_t>(bytes));
+}
+
+inline bool record_less(const WordList &list, const SortRecord &a, const SortRecord &b)
+{
+  if (a.prefix != b.prefix)
+  {
+    return a.prefix < b.prefix;
+  }
+  if (a.length <= 8 || b.length <= 8)
+  {
+    // One side ends inside the prefix, so the shorter word sorts first.
+    return a.length != b.length ? a.length < b.length : a.index < b.index;
+  }
+  int cmp = std::string_view(list.words[a.index]).substr(8).compare(std::string_view(list.words[b.index]).substr(8));
+  return cmp != 0 ? cmp < 0 : a.index < b.index;
+}
+
+std::vector<SortRecord> make_records(const WordList &list, const std::vector<std::size_t> &order)
+{
+  std::vector<SortRecord> records;
+  records.reserve(order.size());
+  for (auto index : order)
+  {
+    const auto &word = list.words[index];
+    records.push_back({key_prefix(word), static_cast<std::uint32_t>(std::min<std::size_t>(word.size(), std::numeric_limits<std::uint32_t>::max())),
+                       static_cast<std::uint32_t>(index)});
+  }
+  return records;
+}
+
+// Sorts `order` by word, keeping equal words in their original order.
+void sort_order(const WordList &list, std::vector<std::size_t> &order)
+{
+  if (list.words.size() > std::numeric_limits<std::uint32_t>::max())
+  {
+    std::stable_sort(order.begin(), order.end(), [&list](std::size_t a, std::size_t b)
+                     { return list.words[a] < list.words[b]; });
+    return;
+  }
+
+  auto records = make_records(list, order);
+  std::sort(records.begin(), records.end(), [&list](const SortRecord &a, const SortRecord &b)
+            { return record_less(list, a, b); });
+
+  for (size_t i = 0; i < records.size(); ++i)
+  {
+    order[i] = records[i].index;
+  }
+}
+
+inline constexpr std::size_t RADIX_CUTOFF = 64;
+inline constexpr std::size_t RADIX_MIN_WORDS = 4096;
+inline constexpr std::size_t MAX_NATURAL_RUNS = 64;
+inline constexpr std::size_t RADIX_MAX_P90_LENGTH = 16;
+
+inline bool same_record(const WordList &list, const SortRecord &a, const SortRecord &b)
+{
+  return a.prefix == b.prefix && a.length == b.length &&
+         (a.length <= 8 || std::string_view(list.words[a.index]).substr(8) == std::string_view(list.words[b.index]).substr(8));
+}
+
+// Stable MSD radix sort on the key prefix. Bucket 0 holds words that end before `byte`; those are
+// identical and need no further work. Buckets that run out of prefix bytes fall back to comparisons.
+// With `deduplicate`, identical words collapse to their first occurrence as soon as their bucket is
+// known, so deeper passes only see distinct words. Returns the number of records kept at `begin`.
+std::size_t radix_sort_records(const WordList &list, SortRecord *begin, SortRecord *end, SortRecord *scratch,
+                               int byte, bool deduplicate)
+{
+  auto less = [&list](const SortRecord &a, const SortRecord &b)
+  { return record_less(list, a, b); };
+  if (static_cast<std::size_t>(end - begin) < RADIX_CUTOFF || byte == 8)
+  {
+    std::sort(begin, end, less);
+    if (deduplicate)
+    {
+      end = std::unique(begin, end, [&list](const SortRecord &a, const SortRecord &b)
+                        { return same_record(list, a, b); });
+    }
+    return static_cast<std::size_t>(end - begin);
+  }
+
+  auto bucket_of = [byte](const SortRecord &record) -> std::size_t
+  {
+    if (record.length <= static_cast<std::uint32_t>(byte))
+    {
+      return 0;
+    }
+    return 1 + ((record.prefix >> (56 - 8 * byte)) & 0xff);
+  };
+
+  std::array<std::size_t, 258> offsets{};
+  for (auto *it = begin; it != end; ++it)
+  {
+    ++offsets[bucket_of(*it) + 1];
+  }
+  for (size_t i = 1; i < offsets.size(); ++i)
+  {
+    offsets[i] += offsets[i - 1];
+  }
+  auto next = offsets;
+  for (auto *it = begin; it != end; ++it)
+  {
+    scratch[next[bucket_of(*it)]++] = *it;
+  }
+  std::copy(scratch, scratch + (end - begin), begin);
+
+  auto *out = begin;
+  for (size_t bucket = 0; bucket < 257; ++bucket)
+  {
+    auto *bucket_begin = begin + offsets[bucket];
+    std::size_t size = offsets[bucket + 1] - offsets[bucket];
+    std::size_t kept = size;
+    if (bucket == 0)
+    {
+      kept = deduplicate ? std::min<std::size_t>(size, 1) : size;
+    }
+    else if (size > 1)
+    {
+      kept = radix_sort_records(list, bucket_begin, bucket_begin + size, scratch, byte + 1, deduplicate);
+    }
+    if (out != bucket_begin)
+    {
+      std::copy(bucket_begin, bucket_begin + kept, out);
+    }
+    out += kept;
+  }
+  return static_cast<std::size_t>(out - begin);
+}
+
+// Ends of the non-descending runs of `order`; stops counting once there are more than `limit`.
+std::vector<std::size_t> natural_runs(const WordList &list, const std::vector<std::size_t> &order, std::size_t limit)
+{
+  std::vector<std::size_t> ends;
+  for (size_t i = 1; i < order.size() && ends.size() <= limit; ++i)
+  {
+    if (list.words[order[i]] < list.words[order[i - 1]])
+    {
+      ends.push_back(i);
+    }
+  }
+  ends.push_back(order.size());
+  return ends;
+}
+
+// Merges the sorted runs of `order` that end at `run_ends`.
+void merge_runs(const WordList &list, std::vector<std::size_t> &order, const std::vector<std::size_t> &run_ends)
+{
+  TraceSpan span("merge");
+  if (run_ends.size() <= 1)
+  {
+    return;
+  }
+  if (list.words.size() > std::numeric_limits<std::uint32_t>::max())
+  {
+    sort_order(list, order);
+    return;
+  }
+
+  auto records = make_records(list, order);
+  auto less = [&list](const SortRecord &a, const SortRecord &b)
+  { return record_less(list, a, b); };
+  std::vector<std::size_t> bounds{0};
+  bounds.insert(bounds.end(), run_ends.begin(), run_ends.end());
+  while (bounds.size() > 2)
+  {
+    std::vector<std::size_t> merged{0};
+    size_t i = 0;
+    for (; i + 2 < bounds.size(); i += 2)
+    {
+      std::inplace_merge(records.begin() + bounds[i], records.begin() + bounds[i + 1], records.begin() + bounds[i + 2], less);
+      merged.push_back(bounds[i + 2]);
+    }
+    if (i + 1 < bounds.size())
+    {
+      merged.push_back(bounds.back());
+    }
+    bounds = std::move(merged);
+  }
+
+  for (size_t i = 0; i < records.size(); ++i)
+  {
+    order[i] = records[i].index;
+  }
+}
+
+inline constexpr std::size_t BITMAP_MAX_LENGTH = 10;
+inline constexpr std::uint64_t BITMAP_MAX_KEYS = std::uint64_t{1} << 34; // a 2 GiB bitmap
+// Keys per word the bitmap may cover: 64 when chosen automatically, and at most 8 KiB of bitmap per
+// word when --engine bitmap forces it, so a handful of long words cannot claim the largest bitmap.
+inline constexpr std::uint64_t BITMAP_KEYS_PER_WORD = 64;
+inline constexpr std::uint64_t BITMAP_FORCED_KEYS_PER_WORD = std::uint64_t{1} << 16;
+
+// Alphabets small enough that every word up to some length can own one bit.
+enum KeyAlphabet
+{
+  kKeyDigits, // 0-9, words up to 10 bytes
+  kKeyHex,    // 0-9a-f, words up to 8 bytes
+  kKeyLower   // a-z, words up to 6 bytes
+};
+
+enum KeySymbol : std::uint8_t
+{
+  kSymbolDigit = 1 << 0,
+  kSymbolHexLetter = 1 << 1,
+  kSymbolLetter = 1 << 2,
+  kSymbolOther = 1 << 3
+};
+
+inline constexpr auto KEY_SYMBOLS = []
+{
+  std::array<std::uint8_t, 256> symbols{};
+  for (int c = 0; c < 256; ++c)
+  {
+    symbols[c] = c >= '0' && c <= '9'   ? kSymbolDigit
+                 : c >= 'a' && c <= 'f' ? kSymbolHexLetter
+                 : c >= 'g' && c <= 'z' ? kSymbolLetter
+                                        : kSymbolOther;
+  }
+  return symbols;
+}();
+
+// Every word over `alphabet` up to `max_length` bytes, numbered in byte order (shorter prefixes first).
+struct Keyspace
+{
+  KeyAlphabet alphabet = kKeyDigits;
+  std::size_t max_length = 0;
+  std::array<std::uint64_t, BITMAP_MAX_LENGTH + 1> upto{}; // upto[m]: number of words of at most m bytes
+  std::uint64_t size = 0;
+
+  std::uint64_t Key(std::string_view word) const
+  {
+    std::uint64_t key = 0;
+    for (size_t i = 0; i < word.size(); ++i)
+    {
+      auto c = static_cast<unsigned char>(word[i]);
+      std::uint64_t digit = alphabet == kKeyLower ? c - 'a' : c <= '9' ? c - '0' : c - 'a' + 10;
+      key += 1 + digit * upto[max_length - 1 - i];
+    }
+    return key;
+  }
+};
+
+// Returns the smallest keyspace holding every word in `order`, or nothing when the words are not
+// provably drawn from one of the bitmap alphabets.
+std::optional<Keyspace> find_keyspace(const WordList &list, const std::vector<std::size_t> &order)
+{
+  std::uint8_t symbols = 0;
+  std::size_t max_length = 0;
+  for (auto index : order)
+  {
+    const auto &word = list.words[index];
+    max_length = std::max(max_length, word.size());
+    for (unsigned char c : word)
+    {
+      symbols |= KEY_SYMBOLS[c];
+    }
+    if ((symbols & kSymbolOther) || max_length > BITMAP_MAX_LENGTH)
+    {
+      return std::nullopt;
+    }
+  }
+
+  Keyspace keyspace;
+  std::uint64_t radix = 0;
+  std::size_t limit = 0;
+  if (!(symbols & (kSymbolHexLetter | kSymbolLetter)))
+  {
+    keyspace.alphabet = kKeyDigits;
+    radix = 10;
+    limit = 10;
+  }
+  else if (!(symbols & kSymbolLetter))
+  {
+    keyspace.alphabet = kKeyHex;
+    radix = 16;
+    limit = 8;
+  }
+  else if (!(symbols & kSymbolDigit))
+  {
+    keyspace.alphabet = kKeyLower;
+    radix = 26;
+    limit = 6;
+  }
+  if (radix == 0 || max_length > limit)
+  {
+    return std::nullopt;
+  }
+
+  keyspace.max_length = max_length;
+  keyspace.upto[0] = 1;
+  for (size_t m = 1; m <= max_length; ++m)
+  {
+    keyspace.upto[m] = keyspace.upto[m - 1] * radix + 1;
+  }
+  keyspace.size = keyspace.upto[max_length];
+  if (keyspace.size > BITMAP_MAX_KEYS)
+  {
+    return std::nullopt;
+  }
+  return keyspace;
+}
+
+// Sorts words from a bounded keyspace (PINs, short hex ids, short lowercase words) without comparing
+// them. Keys are marked in a bitmap; a key's rank among the set bits is its output slot, found with a
+// per-64-bit prefix count and one popcount. With `deduplicate` only the first occurrence of each key
+// is kept, so the output is a linear scan of the bitmap.
+void sort_bitmap(const WordList &list, std::vector<std::size_t> &order, bool deduplicate, const Keyspace &keyspace)
+{
+  std::vector<std::uint64_t> keys;
+  keys.reserve(order.size());
+  for (auto index : order)
+  {
+    keys.push_back(keyspace.Key(list.words[index]));
+  }
+
+  std::vector<std::uint64_t> present(keyspace.size / 64 + 1);
+  for (auto key : keys)
+  {
+    present[key >> 6] |= std::uint64_t{1} << (key & 63);
+  }
+  std::vector<std::uint32_t> ranks(present.size());
+  std::uint32_t distinct = 0;
+  for (size_t i = 0; i < present.size(); ++i)
+  {
+    ranks[i] = distinct;
+    distinct += static_cast<std::uint32_t>(std::popcount(present[i]));
+  }
+  auto rank = [&](std::uint64_t key)
+  {
+    return ranks[key >> 6] + static_cast<std::uint32_t>(std::popcount(present[key >> 6] & ((std::uint64_t{1} << (key & 63)) - 1)));
+  };
+
+  if (deduplicate)
+  {
+    std::vector<std::size_t> firsts(distinct);
+    std::vector<bool> placed(distinct);
+    for (size_t i = 0; i < order.size(); ++i)
+    {
+      auto slot = rank(keys[i]);
+      if (!placed[slot])
+      {
+        placed[slot] = true;
+        firsts[slot] = order[i];
+      }
+    }
+    order = std::move(firsts);
+    return;
+  }
+
+  std::vector<std::size_t> positions(distinct + 1);
+  for (auto key : keys)
+  {
+    ++positions[rank(key) + 1];
+  }
+  for (size_t i = 1; i < positions.size(); ++i)
+  {
+    positions[i] += positions[i - 1];
+  }
+  std::vector<std::size_t> sorted(order.size());
+  for (size_t i = 0; i < order.size(); ++i)
+  {
+    sorted[positions[rank(keys[i])]++] = order[i];
+  }
+  order = std::move(sorted);
+}
+
+// Sorts `order`, choosing the cheapest engine for the data, and returns the engine's name. Sorted
+// input costs one linear check, a few sorted runs are merged, and the rest goes to radix or comparison
+// sorting depending on whether the 8-byte prefixes can carry most of the ordering.
+// With `deduplicate`, the radix engine may also drop repeated words (keeping the first occurrence);
+// callers still collapse adjacent duplicates for the other engines. Words from a bounded keyspace go
+// to the bitmap engine when the bitmap is no larger than the index, or first with `force_bitmap` as
+// long as the bitmap stays within BITMAP_FORCED_KEYS_PER_WORD.
+const char *sort_adaptive(const WordList &list, std::vector<std::size_t> &order, bool deduplicate,
+                          bool force_bitmap = false)
+{
+  TraceSpan span("sort");
+  if (order.size() < 2)
+  {
+    return "presorted";
+  }
+  auto try_bitmap = [&](bool force)
+  {
+    if (order.size() > std::numeric_limits<std::uint32_t>::max())
+    {
+      return false;
+    }
+    auto keyspace = find_keyspace(list, order);
+    if (!keyspace)
+    {
+      return false;
+    }
+    if (keyspace->size / (force ? BITMAP_FORCED_KEYS_PER_WORD : BITMAP_KEYS_PER_WORD) > order.size())
+    {
+      if (force)
+      {
+        std::cerr << "Warning: " << order.size() << " words are too few for a bitmap of " << keyspace->size
+                  << " keys, sorting without --engine bitmap" << std::endl;
+      }
+      return false;
+    }
+    sort_bitmap(list, order, deduplicate, *keyspace);
+    return true;
+  };
+  if (force_bitmap && try_bitmap(true))
+  {
+    return deduplicate ? "bitmap-dedup" : "bitmap";
+  }
+
+  auto run_ends = natural_runs(list, order, MAX_NATURAL_RUNS);
+  if (run_ends.size() == 1)
+  {
+    return "presorted";
+  }
+  if (run_ends.size() <= MAX_NATURAL_RUNS)
+  {
+    merge_runs(list, order, run_ends);
+    return "merge";
+  }
+  if (!force_bitmap && try_bitmap(false))
+  {
+    return deduplicate ? "bitmap-dedup" : "bitmap";
+  }
+
+  std::array<std::size_t, 33> lengths{};
+  for (auto index : order)
+  {
+    ++lengths[std::min<std::size_t>(list.words[index].size(), lengths.size() - 1)];
+  }
+  std::size_t p90 = 0;
+  for (std::size_t seen = 0; p90 < lengths.size() && (seen += lengths[p90]) < order.size() * 9 / 10;)
+  {
+    ++p90;
+  }
+
+  if (order.size() < RADIX_MIN_WORDS || p90 > RADIX_MAX_P90_LENGTH ||
+      list.words.size() > std::numeric_limits<std::uint32_t>::max())
+  {
+    sort_order(list, order);
+    return "comparison";
+  }
+
+  auto records = make_records(list, order);
+  std::vector<SortRecord> scratch(records.size());
+  auto kept = radix_sort_records(list, records.data(), records.data() + records.size(), scratch.data(), 0, deduplicate);
+  order.resize(kept);
+  for (size_t i = 0; i < kept; ++i)
+  {
+    order[i] = records[i].index;
+  }
+  return deduplicate ? "radix-dedup" : "radix";
+}
+
+bool has_transforms(const Options &options)
+{
+  return options.dewebify || options.wordify ||
+         std::any_of(options.pipeline.begin(), options.pipeline.end(), [](const PipelineStage &stage)
+                     { return stage.modifies; });
+}
+
+// Every transform keeps or shrinks a word, so a line shorter than --minlen can never produce a kept word.
+// When only --maxtrim changes lengths, the final length is known up front and --maxlen applies too.
+bool has_shrinking_transforms(const Options &options)
+{
+  return options.dewebify || options.wordify ||
+         std::any_of(options.pipeline.begin(), options.pipeline.end(), [](const PipelineStage &stage)
+                     { return stage.shrinks; });
+}
+
+RejectReason raw_length_reject(std::size_t length, bool exact_length, const Options &options)
+{
+  if (length == 0)
+  {
+    return kRejectEmpty;
+  }
+  if (options.minlen > 0 && length < static_cast<size_t>(options.minlen))
+  {
+    return kRejectMinLength;
+  }
+  if (!exact_length || options.maxlen == 0)
+  {
+    return kRejectNone;
+  }
+  if (options.prefilter_maxtrim > 0)
+  {
+    length = std::min(length, static_cast<size_t>(options.prefilter_maxtrim));
+  }
+  return length > static_cast<size_t>(options.maxlen) ? kRejectMaxLength : kRejectNone;
+}
+
+RejectReason length_reject(const std::string &processed, const Options &options)
+{
+  if (processed.empty())
+  {
+    return kRejectEmpty;
+  }
+  if (options.minlen > 0 && processed.length() < static_cast<size_t>(options.minlen))
+  {
+    return kRejectMinLength;
+  }
+  if (options.maxlen > 0 && processed.length() > static_cast<size_t>(options.maxlen))
+  {
+    return kRejectMaxLength;
+  }
+  return kRejectNone;
+}
+
+inline constexpr std::size_t MIN_SPLIT_BYTES = 1 << 20;
+inline constexpr std::size_t REJECT_BATCH_BYTES = 64 * 1024;
+inline constexpr std::size_t REJECT_QUEUE_BATCHES = 64;
+
+// Writes --reject-log on its own thread. Workers hand over whole batches of lines, so the lock is
+// taken once per batch; a worker only waits when the writer has fallen REJECT_QUEUE_BATCHES behind.
+class RejectLog
+{
+public:
+  static std::unique_ptr<RejectLog> Create(const fs::path &path)
+  {
+    auto log = std::unique_ptr<RejectLog>(new RejectLog());
+    log->file_.open(path, std::ios::binary);
+    if (!log->file_)
+    {
+      std::cerr << "Error: Failed to open reject log: " << path << std::endl;
+      return nullptr;
+    }
+    log->thread_ = std::thread([raw = log.get()]
+                               { raw->Run(); });
+    return log;
+  }
+
+  ~RejectLog() { Close(); }
+
+  void Submit(std::string batch)
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    space_.wait(lock, [this]
+                { return queue_.size() < REJECT_QUEUE_BATCHES; });
+    queue_.push_back(std::move(batch));
+    ready_.notify_one();
+  }
+
+  // Drains the queue and closes the file; returns false if any write failed.
+  bool Close()
+  {
+    if (thread_.joinable())
+    {
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        closing_ = true;
+      }
+      ready_.notify_one();
+      thread_.join();
+      file_.close();
+    }
+    return !file_.fail();
+  }
+
+private:
+  RejectLog() = default;
+
+  void Run()
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true)
+    {
+      ready_.wait(lock, [this]
+                  { return closing_ || !queue_.empty(); });
+      if (queue_.empty())
+      {
+        return;
+      }
+      auto batch = std::move(queue_.front());
+      queue_.pop_front();
+      space_.notify_one();
+      lock.unlock();
+      file_.write(batch.data(), static_cast<std::streamsize>(batch.size()));
+      lock.lock();
+    }
+  }
+
+  std::ofstream file_;
+  std::thread thread_;
+  std::mutex mutex_;
+  std::condition_variable ready_;
+  std::condition_variable space_;
+  std::deque<std::string> queue_;
+  bool closing_ = false;
+};
+
+// A worker's side of the reject log: samples one in every `sample` rejections into a local batch.
+struct RejectSink
+{
+  RejectLog *log = nullptr;
+  std::size_t sample = 1;
+  std::size_t seen = 0;
+  std::string batch;
+
+  void Add(RejectReason reason, std::string_view word)
+  {
+    if (!log || seen++ % sample != 0)
+    {
+      return;
+    }
+    batch.append(REJECT_NAMES[reason]).append("\t").append(word).append("\n");
+    if (batch.size() >= REJECT_BATCH_BYTES)
+    {
+      Flush();
+    }
+  }
+
+  void Flush()
+  {
+    if (log && !batch.empty())
+    {
+      log->Submit(std::move(batch));
+      batch.clear();
+    }
+  }
+};
+
+// Words read from one byte range of one input by a single worker, with its own word store and counters.
+struct Part
+{
+  WordList list;
+  std::vector<std::size_t> order; // local indices in sorted order when `sorted` is set
+  bool sorted = false;
+  const char *sort_engine = "presorted";
+  std::size_t total_words = 0;
+  Stats stats;
+  Stats published; // what publish_part has already added to Metrics
+  std::size_t published_words = 0;
+  RejectSink rejects;
+};
+
+inline constexpr std::size_t METRICS_PUBLISH_LINES = 1 << 16;
+
+// Process-wide counters for --metrics-file. Workers count into their Part and publish the difference
+// every METRICS_PUBLISH_LINES lines, so the hot loop touches no shared memory and a publish costs a
+// handful of relaxed adds.
+class Metrics
+{
+public:
+  enum Phase
+  {
+    kPhaseStart,
+    kPhasePlan,
+    kPhaseRead,
+    kPhaseSort,
+    kPhaseWrite,
+    kPhaseDone,
+    kPhaseCount
+  };
+
+  static void SetPhase(Phase phase) { phase_.store(phase, std::memory_order_relaxed); }
+  static void SetFiles(std::size_t files) { files_.store(files, std::memory_order_relaxed); }
+  static void FileDone() { files_done_.fetch_add(1, std::memory_order_relaxed); }
+  static void WorkerStarted() { workers_.fetch_add(1, std::memory_order_relaxed); }
+  static void WorkerFinished() { workers_.fetch_sub(1, std::memory_order_relaxed); }
+  static void SetWordsOut(std::size_t words) { words_out_.store(words, std::memory_order_relaxed); }
+
+  // Adds what `part` counted since its last publish; `bytes_done` is how far into its range it got.
+  static void Publish(Part &part, std::uint64_t bytes_done)
+  {
+    auto add = [](std::atomic<std::uint64_t> &counter, std::uint64_t now, std::uint64_t then)
+    { counter.fetch_add(now - then, std::memory_order_relaxed); };
+    add(bytes_read_, bytes_done, part.published.bytes_read);
+    add(lines_, part.stats.lines, part.published.lines);
+    add(words_in_, part.total_words, part.published_words);
+    for (size_t i = 0; i < rejected_.size(); ++i)
+    {
+      add(rejected_[i], part.stats.rejected[i], part.published.rejected[i]);
+    }
+    part.published.bytes_read = bytes_done;
+    part.published.lines = part.stats.lines;
+    part.published.rejected = part.stats.rejected;
+    part.published_words = part.total_words;
+  }
+
+  // Renders the counters in the Prometheus text exposition format.
+  static std::string Render()
+  {
+    constexpr std::array<const char *, kPhaseCount> phases = {"start", "plan", "read", "sort", "write", "done"};
+    std::ostringstream out;
+    auto metric = [&out](const char *name, const char *type, const char *help)
+    {
+      out << "# HELP wordlist_sort_" << name << " " << help << "\n";
+      out << "# TYPE wordlist_sort_" << name << " " << type << "\n";
+    };
+    auto load = [](const auto &counter)
+    { return counter.load(std::memory_order_relaxed); };
+
+    metric("bytes_read_total", "counter", "Input bytes parsed.");
+    out << "wordlist_sort_bytes_read_total " << load(bytes_read_) << "\n";
+    metric("lines_total", "counter", "Input lines parsed.");
+    out << "wordlist_sort_lines_total " << load(lines_) << "\n";
+    metric("words_in_total", "counter", "Words that passed every filter.");
+    out << "wordlist_sort_words_in_total " << load(words_in_) << "\n";
+    metric("words_out", "gauge", "Words written, set once the output is complete.");
+    out << "wordlist_sort_words_out " << load(words_out_) << "\n";
+    metric("rejected_total", "counter", "Words or lines dropped, by reason.");
+    for (size_t i = kRejectNone + 1; i < rejected_.size(); ++i)
+    {
+      out << "wordlist_sort_rejected_total{reason=\"" << REJECT_NAMES[i] << "\"} " << load(rejected_[i]) << "\n";
+    }
+    metric("files", "gauge", "Input files given.");
+    out << "wordlist_sort_files " << load(files_) << "\n";
+    metric("files_done", "gauge", "Input files read completely.");
+    out << "wordlist_sort_files_done " << load(files_done_) << "\n";
+    metric("active_workers", "gauge", "Threads currently parsing an input range.");
+    out << "wordlist_sort_active_workers " << load(workers_) << "\n";
+    metric("phase", "gauge", "1 for the phase the run is in.");
+    for (size_t i = 0; i < phases.size(); ++i)
+    {
+      out << "wordlist_sort_phase{phase=\"" << phases[i] << "\"} " << (load(phase_) == static_cast<int>(i)) << "\n";
+    }
+    return out.str();
+  }
+
+private:
+  static inline std::atomic<std::uint64_t> bytes_read_{0};
+  static inline std::atomic<std::uint64_t> lines_{0};
+  static inline std::atomic<std::uint64_t> words_in_{0};
+  static inline std::atomic<std::uint64_t> words_out_{0};
+  static inline std::array<std::atomic<std::uint64_t>, kRejectCount> rejected_{};
+  static inline std::atomic<std::uint64_t> files_{0};
+  static inline std::atomic<std::uint64_t> files_done_{0};
+  static inline std::atomic<int> workers_{0};
+  static inline std::atomic<int> phase_{kPhaseStart};
+};
+
+// Rewrites a Prometheus textfile-collector file every `interval` until destroyed, then once more.
+// Each rewrite goes to a temporary file that is renamed over the target, so a scrape never sees a
+// half-written file.
+class MetricsWriter
+{
+public:
+  static std::unique_ptr<MetricsWriter> Create(const fs::path &path, std::chrono::milliseconds interval)
+  {
+    auto writer = std::unique_ptr<MetricsWriter>(new MetricsWriter(path, interval));
+    if (!writer->Write())
+    {
+      std::cerr << "Error: Failed to write metrics file: " << path << std::endl;
+      return nullptr;
+    }
+    writer->thread_ = std::thread([raw = writer.get()]
+                                  { raw->Run(); });
+    return writer;
+  }
+
+  ~MetricsWriter()
+  {
+    // Create gives up before starting the thread when the first write fails.
+    if (!thread_.joinable())
+    {
+      return;
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stopping_ = true;
+    }
+    wake_.notify_one();
+    thread_.join();
+    Write();
+  }
+
+private:
+  MetricsWriter(const fs::path &path, std::chrono::milliseconds interval) : path_(path), interval_(interval) {}
+
+  void Run()
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (!wake_.wait_for(lock, interval_, [this]
+                           { return stopping_; }))
+    {
+      Write();
+    }
+  }
+
+  bool Write() const
+  {
+    fs::path temporary = path_;
+    temporary += ".tmp";
+    {
+      std::ofstream file(temporary);
+      file << Metrics::Render();
+      if (!file)
+      {
+        return false;
+      }
+    }
+    std::error_code error;
+    fs::rename(temporary, path_, error);
+    return !error;
+  }
+
+  fs::path path_;
+  std::chrono::milliseconds interval_;
+  std::thread thread_;
+  std::mutex mutex_;
+  std::condition_variable wake_;
+  bool stopping_ = false;
+};
+
+// Stores a kept word in the part's word store, unless hash sampling or the reservoir drops it.
+void store_word(std::string processed, Part &part, const Options &options, std::uint64_t origin,
+                const std::uint64_t *hash = nullptr, std::uint32_t weight = 1)
+{
+  auto &list = part.list;
+  bool sampling = options.sample_threshold != std::numeric_limits<std::uint64_t>::max();
+  std::uint64_t word_hash = hash ? *hash : (list.hashed || sampling) ? hash_word(processed) : 0;
+  // Hash-based sampling: the same word is always in or always out, whatever the input order.
+  if (sampling && word_hash > options.sample_threshold)
+  {
+    return;
+  }
+
+  if (list.reservoir)
+  {
+    auto slot = list.reservoir->Offer();
+    if (slot == Reservoir::npos)
+    {
+      return;
+    }
+    if (slot < list.words.size())
+    {
+      list.words[slot] = std::move(processed);
+      if (list.hashed)
+      {
+        list.hashes[slot] = word_hash;
+      }
+      if (list.tracked)
+      {
+        list.origins[slot] = origin;
+      }
+      if (list.weighted)
+      {
+        list.weights[slot] = weight;
+      }
+      return;
+    }
+  }
+
+  if (list.hashed)
+  {
+    list.hashes.push_back(word_hash);
+  }
+  if (list.tracked)
+  {
+    list.origins.push_back(origin);
+  }
+  if (list.weighted)
+  {
+    list.weights.push_back(weight);
+  }
+  list.words.push_back(std::move(processed));
+}
+
+// Streams the leet spellings of a word one at a time. Every substitutable letter cycles through
+// itself and its LEET_SUBSTITUTIONS like an odometer digit, so only the current variant is ever held.
+class LeetVariants
+{
+public:
+  explicit LeetVariants(std::string_view word) : word_(word)
+  {
+    for (size_t i = 0; i < word_.size(); ++i)
+    {
+      if (LEET_SPELLINGS[static_cast<unsigned char>(word_[i])])
+      {
+        positions_.push_back(i);
+      }
+    }
+    choices_.assign(positions_.size(), 0);
+  }
+
+  // Writes the next variant to `variant`; false once every combination has been produced.
+  bool Next(std::string &variant)
+  {
+    for (size_t p = 0; p < positions_.size(); ++p)
+    {
+      auto spellings = LEET_SPELLINGS[static_cast<unsigned char>(word_[positions_[p]])];
+      if (spellings[choices_[p]] != 0)
+      {
+        ++choices_[p];
+        variant = word_;
+        for (size_t q = 0; q < positions_.size(); ++q)
+        {
+          if (choices_[q] > 0)
+          {
+            variant[positions_[q]] = LEET_SPELLINGS[static_cast<unsigned char>(word_[positions_[q]])][choices_[q] - 1];
+          }
+        }
+        return true;
+      }
+      choices_[p] = 0;
+    }
+    return false;
+  }
+
+private:
+  std::string word_;
+  std::vector<size_t> positions_;
+  std::vector<size_t> choices_;
+};
+
+// Counts a word that came out of processing and stores it unless a filter or the sampler drops it.
+// `reason` is the filter process_word already applied, if any; `input` is the word before processing.
+// `weight` is the number of occurrences the word stands for, above one only for counted binary input.
+void keep_word(std::string processed, RejectReason reason, std::string_view input, Part &part, const Options &options,
+               std::uint64_t origin, const std::uint64_t *hash = nullptr, std::uint32_t weight = 1)
+{
+  if (reason == kRejectNone)
+  {
+    reason = length_reject(processed, options);
+  }
+  if (reason != kRejectNone)
+  {
+    ++part.stats.rejected[reason];
+    part.rejects.Add(reason, input);
+    return;
+  }
+  part.total_words++;
+  if (options.leet_variants == 0)
+  {
+    store_word(std::move(processed), part, options, origin, hash, weight);
+    return;
+  }
+
+  LeetVariants variants(processed);
+  store_word(std::move(processed), part, options, origin, hash, weight);
+  std::string variant;
+  for (size_t n = 0; n < options.leet_variants && variants.Next(variant); ++n)
+  {
+    part.total_words++;
+    store_word(variant, part, options, origin, nullptr, weight);
+  }
+}
+
+Part make_part(const Options &options, std::uint64_t seed)
+{
+  Part part;
+  part.list.hashed = needs_hashes(options);
+  part.list.tracked = !options.provenance.empty();
+  part.list.weighted = needs_weights(options);
+  if (options.reservoir > 0)
+  {
+    part.list.reservoir.emplace(options.reservoir, seed);
+  }
+  part.rejects.log = options.reject_log;
+  part.rejects.sample = options.reject_sample;
+  return part;
+}
+
+// One output of the run. Every target sees the same input lines, each through its own options, parts
+// and word store, so several filter windows cost one read and one line split.
+struct Target
+{
+  Options options;
+  fs::path output;
+  std::vector<Part> parts;
+  WordList list;
+  SortedRuns runs;
+  std::size_t total_words = 0;
+  std::size_t unique_words = 0;
+  Stats stats;
+};
+
+// Starts a target at `output` from the main options, without the outputs only the main run writes.
+void init_target(Target &target, const fs::path &output, const Options &base)
+{
+  target.output = output;
+  target.options = base;
+  target.options.provenance.clear();
+  target.options.reject_log = nullptr;
+}
+
+// Parses an --also spec, PATH[:key[=value],...], into a target that starts from `base`.
+bool parse_target(const std::string &spec, const Options &base, Target &target)
+{
+  auto colon = spec.find(':');
+  init_target(target, spec.substr(0, colon), base);
+  if (target.output.empty())
+  {
+    std::cerr << "Error: Missing output path in --also " << spec << std::endl;
+    return false;
+  }
+
+  auto &options = target.options;
+  // Settings marked `stage` only shape the pipeline built from flags, so a pipeline spec would ignore them.
+  struct Number
+  {
+    const char *name;
+    int *value;
+    bool stage;
+  };
+  struct Flag
+  {
+    const char *name;
+    bool *value;
+    bool stage;
+  };
+  const std::array<Number, 5> numbers = {{
+      {"minlen", &options.minlen, false},
+      {"maxlen", &options.maxlen, false},
+      {"maxtrim", &options.maxtrim, true},
+      {"dup-sense", &options.dup_sense, true},
+      {"min-classes", &options.min_classes, true},
+  }};
+  const std::array<Flag, 14> flags = {{
+      {"lower", &options.lower, true},
+      {"unleet", &options.unleet, true},
+      {"leet-dedup", &options.leet_dedup, false},
+      {"digit-trim", &options.digit_trim, true},
+      {"special-trim", &options.special_trim, true},
+      {"dup-remove", &options.dup_remove, true},
+      {"detab", &options.detab, true},
+      {"no-numbers", &options.no_numbers, true},
+      {"hash-remove", &options.hash_remove, true},
+      {"junk-remove", &options.junk_remove, true},
+      {"junk-tag", &options.junk_tag, false},
+      {"sort-score", &options.sort_score, false},
+      {"sort", &options.sort, false},
+      {"deduplicate", &options.deduplicate, false},
+  }};
+  std::string_view stage_setting;
+
+  std::string_view settings = colon == std::string::npos ? std::string_view{} : std::string_view(spec).substr(colon + 1);
+  while (!settings.empty())
+  {
+    auto comma = settings.find(',');
+    auto setting = settings.substr(0, comma);
+    settings.remove_prefix(comma == std::string_view::npos ? settings.size() : comma + 1);
+
+    auto equals = setting.find('=');
+    auto key = setting.substr(0, equals);
+    auto value = equals == std::string_view::npos ? std::string_view("1") : setting.substr(equals + 1);
+    int number = 0;
+    auto [end, error] = std::from_chars(value.data(), value.data() + value.size(), number);
+    bool numeric = error == std::errc{} && end == value.data() + value.size() && number >= 0;
+
+    auto known_number = std::find_if(numbers.begin(), numbers.end(), [&](const Number &entry)
+                                     { return key == entry.name; });
+    auto known_flag = std::find_if(flags.begin(), flags.end(), [&](const Flag &entry)
+                                   { return key == entry.name; });
+    auto known_script = std::find_if(SCRIPT_NAMES.begin(), SCRIPT_NAMES.end(), [&](const char *name)
+                                     { return value == name; });
+    if (key == "script" && known_script != SCRIPT_NAMES.end())
+    {
+      options.script = static_cast<Script>(known_script - SCRIPT_NAMES.begin());
+    }
+    else if (key == "pipeline" && equals != std::string_view::npos)
+    {
+      options.pipeline_spec = value;
+    }
+    else if (known_number != numbers.end() && numeric)
+    {
+      *known_number->value = number;
+      stage_setting = known_number->stage && stage_setting.empty() ? key : stage_setting;
+    }
+    else if (known_flag != flags.end() && numeric && number <= 1)
+    {
+      *known_flag->value = number == 1;
+      stage_setting = known_flag->stage && stage_setting.empty() ? key : stage_setting;
+    }
+    else
+    {
+      std::cerr << "Error: Invalid setting '" << setting << "' in --also " << spec << std::endl;
+      return false;
+    }
+  }
+  if (!options.pipeline_spec.empty() && !stage_setting.empty())
+  {
+    std::cerr << "Error: '" << stage_setting << "' has no effect with a pipeline in --also " << spec
+              << "; give the output its own pipeline=... instead" << std::endl;
+    return false;
+  }
+  if (options.binary_counts && !options.deduplicate)
+  {
+    std::cerr << "Error: --binary-counts requires deduplicate in --also " << spec << std::endl;
+    return false;
+  }
+  if (options.leet_dedup && !options.deduplicate)
+  {
+    std::cerr << "Error: leet-dedup requires deduplicate in --also " << spec << std::endl;
+    return false;
+  }
+  return compile_pipeline(options);
+}
+
+// Duplicates can be dropped inside the sort unless their occurrences have to be counted.
+bool collapses_in_sort(const Options &options)
+{
+  return options.deduplicate && !(options.binary_out && options.binary_counts);
+}
+
+// Sorts the part locally so the final sort only has to merge runs. Reservoir parts are resampled
+// when merged, so sorting them here would be wasted, and a forced bitmap sort covers the whole list.
+void finish_part(Part &part, const Options &options)
+{
+  if (!options.sort || options.hash_first || options.leet_dedup || part.list.reservoir || options.engine == "bitmap")
+  {
+    return;
+  }
+  if (!part.sorted)
+  {
+    part.order.resize(part.list.words.size());
+    std::iota(part.order.begin(), part.order.end(), 0);
+    part.sort_engine = sort_adaptive(part.list, part.order, collapses_in_sort(options));
+    part.sorted = true;
+  }
+}
+
+bool is_binary_content(std::string_view content)
+{
+  return content.size() >= BINARY_HEADER_SIZE && std::memcmp(content.data(), BINARY_MAGIC, 4) == 0;
+}
+
+[[nodiscard]] bool process_binary_content(std::string_view content, const fs::path &path, std::size_t file_id,
+                                          Part &part, const Options &options)
+{
+  TraceSpan span("decode");
+  auto &list = part.list;
+  const char *file_start = content.data();
+  if (load_le<std::uint16_t>(content.data() + 4) != BINARY_VERSION)
+  {
+    std::cerr << "Error: Unsupported binary format version in " << path << std::endl;
+    return false;
+  }
+  auto flags = load_le<std::uint16_t>(content.data() + 6);
+  content.remove_prefix(BINARY_HEADER_SIZE);
+
+  while (!content.empty())
+  {
+    if (content.size() < BINARY_BLOCK_HEADER_SIZE)
+    {
+      std::cerr << "Error: Truncated block header in " << path << std::endl;
+      return false;
+    }
+    auto word_count = load_le<std::uint32_t>(content.data());
+    auto payload_bytes = load_le<std::uint32_t>(content.data() + 4);
+    auto checksum = load_le<std::uint64_t>(content.data() + 8);
+    content.remove_prefix(BINARY_BLOCK_HEADER_SIZE);
+
+    std::size_t offsets_bytes = (static_cast<std::size_t>(word_count) + 1) * sizeof(std::uint32_t);
+    if (content.size() < payload_bytes || payload_bytes < offsets_bytes)
+    {
+      std::cerr << "Error: Truncated block in " << path << std::endl;
+      return false;
+    }
+    const char *payload = content.data();
+    if (hash_bytes(payload, payload_bytes) != checksum)
+    {
+      std::cerr << "Error: Block checksum mismatch in " << path << std::endl;
+      return false;
+    }
+
+    const char *data = payload + offsets_bytes;
+    auto data_bytes = load_le<std::uint32_t>(payload + offsets_bytes - sizeof(std::uint32_t));
+    std::size_t hashes_offset = (offsets_bytes + data_bytes + 7) / 8 * 8;
+    bool has_hashes = (flags & kBinaryHashes) != 0;
+    bool has_counts = (flags & kBinaryCounts) != 0;
+    std::size_t counts_offset = hashes_offset + (has_hashes ? word_count * sizeof(std::uint64_t) : 0);
+    if (offsets_bytes + data_bytes > payload_bytes ||
+        (has_hashes && hashes_offset + word_count * sizeof(std::uint64_t) > payload_bytes) ||
+        (has_counts && counts_offset + word_count * sizeof(std::uint32_t) > payload_bytes))
+    {
+      std::cerr << "Error: Corrupt offset table in " << path << std::endl;
+      return false;
+    }
+    // Stored hashes stay valid as long as the words pass through unchanged.
+    bool reuse_hashes = has_hashes && !has_transforms(options);
+
+    for (std::uint32_t i = 0; i < word_count; ++i)
+    {
+      auto begin = load_le<std::uint32_t>(payload + i * sizeof(std::uint32_t));
+      auto end = load_le<std::uint32_t>(payload + (i + 1) * sizeof(std::uint32_t));
+      if (begin > end || end > data_bytes)
+      {
+        std::cerr << "Error: Corrupt offset table in " << path << std::endl;
+        return false;
+      }
+      std::string_view word(data + begin, end - begin);
+      auto origin = make_origin(file_id, static_cast<std::size_t>(word.data() - file_start));
+      std::uint64_t hash = reuse_hashes ? load_le<std::uint64_t>(payload + hashes_offset + i * sizeof(std::uint64_t)) : 0;
+      // A counted word stands for all its occurrences in the run that wrote it.
+      std::uint32_t weight = has_counts ? load_le<std::uint32_t>(payload + counts_offset + i * sizeof(std::uint32_t)) : 1;
+      if (!options.pipeline.empty())
+      {
+        RejectReason reason = kRejectNone;
+        auto processed = process_word(word, options, &reason);
+        keep_word(std::move(processed), reason, word, part, options, origin, reuse_hashes ? &hash : nullptr, weight);
+      }
+      else
+      {
+        keep_word(std::string(word), kRejectNone, word, part, options, origin, reuse_hashes ? &hash : nullptr, weight);
+      }
+    }
+
+    content.remove_prefix(payload_bytes);
+  }
+
+  if ((flags & kBinarySorted) && !has_transforms(options) && options.leet_variants == 0 && !list.reservoir)
+  {
+    // Already in order: the part is one sorted run as read. Leet variants are stored after each word
+    // and would break the order.
+    part.order.resize(list.words.size());
+    std::iota(part.order.begin(), part.order.end(), 0);
+    part.sorted = true;
+  }
+  part.rejects.Flush();
+  return true;
+}
+
+// Applies the line-level options and hands every resulting word to `emit`.
+template <typename Emit>
+void process_line(std::string_view line_view, const Options &options, Emit &&emit)
+{
+  std::string line_str;
+  if (options.dewebify)
+  {
+    line_str = strip_html_tags(line_view);
+    if (options.noutf8)
+    {
+      line_str.erase(std::remove_if(line_str.begin(), line_str.end(),
+                                    [](unsigned char c)
+                                    { return c <= 127; }),
+                     line_str.end());
+    }
+    line_view = line_str;
+  }
+
+  if (options.wordify)
+  {
+    std::istringstream iss{std::string(line_view)};
+    std::string subword;
+    while (iss >> subword)
+    {
+      RejectReason reason = kRejectNone;
+      auto processed = process_word(subword, options, &reason);
+      emit(std::move(processed), reason, subword);
+    }
+  }
+  else
+  {
+    RejectReason reason = kRejectNone;
+    auto processed = process_word(line_view, options, &reason);
+    emit(std::move(processed), reason, line_view);
+  }
+}
+
+// Splits one byte range into lines once and feeds each line to every target's part `index`.
+void process_text_range(std::string_view content, const char *file_start, std::size_t file_id,
+                        std::vector<Target> &targets, std::size_t index)
+{
+  TraceSpan span("parse");
+  std::vector<char> exact_length;
+  for (const auto &target : targets)
+  {
+    exact_length.push_back(!has_shrinking_transforms(target.options));
+  }
+  auto &primary = targets.front().parts[index];
+  const char *range_start = content.data();
+  const std::uint64_t range_bytes = content.size();
+  while (!content.empty())
+  {
+    auto line_end = content.find('\n');
+    std::string_view line = content.substr(0, line_end);
+    for (size_t t = 0; t < targets.size(); ++t)
+    {
+      auto &part = targets[t].parts[index];
+      const auto &options = targets[t].options;
+      ++part.stats.lines;
+      ++part.stats.line_lengths[std::min(line.size(), HISTOGRAM_BUCKETS - 1)];
+
+      if (auto reason = raw_length_reject(line.size(), exact_length[t], options); reason != kRejectNone)
+      {
+        ++part.stats.prefiltered;
+        ++part.stats.rejected[reason];
+        part.rejects.Add(reason, line);
+      }
+      else
+      {
+        auto origin = make_origin(file_id, static_cast<std::size_t>(line.data() - file_start));
+        process_line(line, options, [&](std::string processed, RejectReason reason, std::string_view input)
+                     { keep_word(std::move(processed), reason, input, part, options, origin); });
+      }
+    }
+
+    if (line_end == std::string_view::npos)
+    {
+      break;
+    }
+    content.remove_prefix(line_end + 1);
+    if (primary.stats.lines % METRICS_PUBLISH_LINES == 0)
+    {
+      Metrics::Publish(primary, static_cast<std::uint64_t>(content.data() - range_start));
+    }
+  }
+  Metrics::Publish(primary, range_bytes);
+  for (auto &target : targets)
+  {
+    target.parts[index].rejects.Flush();
+  }
+}
+
+// Splits `content` into up to `count` ranges that each end just after a newline, so no line (and no
+// CRLF pair) is cut in two.
+std::vector<std::string_view> split_ranges(std::string_view content, std::size_t count)
+{
+  count = std::clamp<std::size_t>(content.size() / MIN_SPLIT_BYTES, 1, std::max<std::size_t>(count, 1));
+  std::vector<std::string_view> ranges;
+  std::size_t begin = 0;
+  for (size_t i = 1; i <= count && begin < content.size(); ++i)
+  {
+    std::size_t end = content.size();
+    if (i < count)
+    {
+      auto newline = content.find('\n', std::max(begin, content.size() / count * i));
+      end = newline == std::string_view::npos ? content.size() : newline + 1;
+    }
+    ranges.push_back(content.substr(begin, end - begin));
+    begin = end;
+  }
+  return ranges;
+}
+
+[[nodiscard]] bool process_file(const fs::path &path, std::size_t file_id, std::vector<Target> &targets)
+{
+  auto file = CompressedMemoryMappedFile::Create(path);
+  if (!file)
+  {
+    std::cerr << "Error: Failed to open file: " << path << std::endl;
+    return false;
+  }
+
+  std::string_view file_content(file->data(), file->size());
+
+  if (is_binary_content(file_content))
+  {
+    for (auto &target : targets)
+    {
+      auto &part = target.parts.emplace_back(make_part(target.options, target.parts.size()));
+      part.stats.bytes_read += file_content.size();
+      if (!process_binary_content(file_content, path, file_id, part, target.options))
+      {
+        return false;
+      }
+      finish_part(part, target.options);
+    }
+    Metrics::Publish(targets.front().parts.back(), file_content.size());
+    return true;
+  }
 
-  if (options.dewebify)
+  auto ranges = split_ranges(file_content, targets.front().options.threads);
+  std::size_t first = targets.front().parts.size();
+  for (auto &target : targets)
+  {
+    for (const auto &range : ranges)
+    {
+      target.parts.push_back(make_part(target.options, target.parts.size()));
+      target.parts.back().stats.bytes_read += range.size();
+    }
+  }
+
+  auto work = [&](std::size_t i)
+  {
+    Metrics::WorkerStarted();
+    process_text_range(ranges[i], file->data(), file_id, targets, first + i);
+    for (auto &target : targets)
+    {
+      finish_part(target.parts[first + i], target.options);
+    }
+    Metrics::WorkerFinished();
+  };
+
+  std::vector<std::thread> workers;
+  for (size_t i = 1; i < ranges.size(); ++i)
+  {
+    workers.emplace_back(work, i);
+  }
+  if (!ranges.empty())
+  {
+    work(0);
+  }
+  for (auto &worker : workers)
+  {
+    worker.join();
+  }
+
+  return true;
+}
+
+// Draws the final sample from per-part reservoirs. Each part holds a uniform sample of the words it
+// saw, so picking parts in proportion to their not yet drawn words keeps the merged sample uniform.
+void merge_reservoirs(std::vector<Part> &parts, std::size_t capacity, WordList &list)
+{
+  std::vector<std::uint64_t> remaining;
+  std::uint64_t total = 0;
+  for (const auto &part : parts)
+  {
+    remaining.push_back(part.list.reservoir->Seen());
+    total += remaining.back();
+  }
+
+  std::mt19937_64 rng(0x5eed ^ parts.size());
+  while (list.words.size() < capacity && total > 0)
+  {
+    auto pick = rng() % total;
+    size_t p = 0;
+    while (pick >= remaining[p])
+    {
+      pick -= remaining[p++];
+    }
+    auto &source = parts[p].list;
+    auto j = static_cast<std::size_t>(rng() % source.words.size());
+    list.words.push_back(std::move(source.words[j]));
+    source.words[j] = std::move(source.words.back());
+    source.words.pop_back();
+    if (list.hashed)
+    {
+      list.hashes.push_back(source.hashes[j]);
+      source.hashes[j] = source.hashes.back();
+      source.hashes.pop_back();
+    }
+    if (list.tracked)
+    {
+      list.origins.push_back(source.origins[j]);
+      source.origins[j] = source.origins.back();
+      source.origins.pop_back();
+    }
+    if (list.weighted)
+    {
+      list.weights.push_back(source.weights[j]);
+      source.weights[j] = source.weights.back();
+      source.weights.pop_back();
+    }
+    --remaining[p];
+    --total;
+  }
+}
+
+// Concatenates the parts in input order. When every part is a sorted run, `runs` describes them so
+// the final sort only has to merge.
+void combine_parts(std::vector<Part> &parts, const Options &options, WordList &list, SortedRuns &runs,
+                   std::size_t &total_words, Stats &stats)
+{
+  TraceSpan span("combine");
+  list.hashed = needs_hashes(options);
+  list.tracked = !options.provenance.empty();
+  list.weighted = needs_weights(options);
+  runs.sorted = !parts.empty();
+  for (auto &part : parts)
+  {
+    total_words += part.total_words;
+    stats.Add(part.stats);
+    runs.sorted = runs.sorted && part.sorted;
+  }
+  if (parts.size() == 1)
+  {
+    runs.engine = parts.front().sort_engine;
+  }
+
+  if (options.reservoir > 0)
+  {
+    merge_reservoirs(parts, options.reservoir, list);
+    runs.sorted = false;
+    return;
+  }
+
+  for (auto &part : parts)
+  {
+    auto base = list.words.size();
+    if (runs.sorted)
+    {
+      for (auto index : part.order)
+      {
+        runs.order.push_back(base + index);
+      }
+      runs.ends.push_back(runs.order.size());
+    }
+    list.words.insert(list.words.end(), std::make_move_iterator(part.list.words.begin()),
+                      std::make_move_iterator(part.list.words.end()));
+    list.hashes.insert(list.hashes.end(), part.list.hashes.begin(), part.list.hashes.end());
+    list.origins.insert(list.origins.end(), part.list.origins.begin(), part.list.origins.end());
+    list.weights.insert(list.weights.end(), part.list.weights.begin(), part.list.weights.end());
+    part = Part{};
+  }
+}
+
+bool process_multiple_files(const std::vector<fs::path> &paths, std::vector<Target> &targets,
+                            std::atomic<size_t> &total_words)
+{
+  for (size_t file_id = 0; file_id < paths.size(); ++file_id)
+  {
+    if (!process_file(paths[file_id], file_id, targets))
+    {
+      return false;
+    }
+    Metrics::FileDone();
+  }
+
+  for (auto &target : targets)
+  {
+    combine_parts(target.parts, target.options, target.list, target.runs, target.total_words, target.stats);
+  }
+  total_words += targets.front().total_words;
+  return true;
+}
+
+class OutputFile
+{
+public:
+  static std::unique_ptr<OutputFile> Create(const fs::path &path)
+  {
+    auto output = std::unique_ptr<OutputFile>(new OutputFile());
+    if (!output->Initialize(path))
+    {
+      return nullptr;
+    }
+    return output;
+  }
+
+  bool Write(const std::string &str)
+  {
+    file_ << str << '\n';
+    return !file_.fail();
+  }
+
+  bool Write(const std::string &str, std::string_view tag)
+  {
+    file_ << str << '\t' << tag << '\n';
+    return !file_.fail();
+  }
+
+private:
+  OutputFile() = default;
+
+  bool Initialize(const fs::path &path)
+  {
+    file_.open(path);
+    return file_.is_open();
+  }
+
+  std::ofstream file_;
+};
+
+// With `tag_junk`, words that classify_junk recognises get a tab and their kind appended.
+bool write_result_to_file(const WordList &list, const std::vector<std::size_t> &order, const fs::path &output_path,
+                          bool tag_junk = false)
+{
+  TraceSpan span("write");
+  auto output = OutputFile::Create(output_path);
+  if (!output)
+  {
+    std::cerr << "Error: Failed to open output file: " << output_path << std::endl;
+    return false;
+  }
+
+  for (auto index : order)
+  {
+    const auto &word = list.words[index];
+    auto junk = tag_junk ? classify_junk(word) : kJunkNone;
+    if (!(junk == kJunkNone ? output->Write(word) : output->Write(word, JUNK_NAMES[junk])))
+    {
+      std::cerr << "Error: Failed to write to output file" << std::endl;
+      return false;
+    }
+  }
+
+  return true;
+}
+
+// Writes "word<TAB>file_id<TAB>offset" for every output word, after "# file_id<TAB>path" header lines.
+bool write_provenance(const WordList &list, const std::vector<std::size_t> &order,
+                      const std::vector<fs::path> &input_paths, const fs::path &provenance_path)
+{
+  TraceSpan span("write provenance");
+  auto output = OutputFile::Create(provenance_path);
+  if (!output)
+  {
+    std::cerr << "Error: Failed to open provenance file: " << provenance_path << std::endl;
+    return false;
+  }
+
+  std::string line;
+  for (size_t file_id = 0; file_id < input_paths.size(); ++file_id)
+  {
+    line = "# " + std::to_string(file_id) + "\t" + input_paths[file_id].string();
+    if (!output->Write(line))
+    {
+      return false;
+    }
+  }
+
+  constexpr std::uint64_t offset_mask = (std::uint64_t{1} << ORIGIN_OFFSET_BITS) - 1;
+  for (auto index : order)
+  {
+    auto origin = list.origins[index];
+    line.assign(list.words[index]);
+    line.append("\t").append(std::to_string(origin >> ORIGIN_OFFSET_BITS));
+    line.append("\t").append(std::to_string(origin & offset_mask));
+    if (!output->Write(line))
+    {
+      std::cerr << "Error: Failed to write to provenance file" << std::endl;
+      return false;
+    }
+  }
+
+  return true;
+}
+
+class BinaryOutputFile
+{
+public:
+  static std::unique_ptr<BinaryOutputFile> Create(const fs::path &path, std::uint16_t flags)
+  {
+    auto output = std::unique_ptr<BinaryOutputFile>(new BinaryOutputFile(flags));
+    if (!output->Initialize(path))
+    {
+      return nullptr;
+    }
+    return output;
+  }
+
+  bool Write(std::string_view word, std::uint64_t hash, std::uint32_t count)
+  {
+    if (offsets_.size() > BINARY_BLOCK_WORDS || data_.size() + word.size() > BINARY_BLOCK_BYTES)
+    {
+      if (!FlushBlock())
+      {
+        return false;
+      }
+    }
+    data_.append(word);
+    offsets_.push_back(static_cast<std::uint32_t>(data_.size()));
+    if (flags_ & kBinaryHashes)
+    {
+      hashes_.push_back(hash);
+    }
+    if (flags_ & kBinaryCounts)
+    {
+      counts_.push_back(count);
+    }
+    return true;
+  }
+
+  bool Finish()
+  {
+    return FlushBlock() && !file_.fail();
+  }
+
+private:
+  explicit BinaryOutputFile(std::uint16_t flags) : flags_(flags) { offsets_.push_back(0); }
+
+  bool Initialize(const fs::path &path)
+  {
+    file_.open(path, std::ios::binary);
+    if (!file_.is_open())
+    {
+      return false;
+    }
+    std::string header(BINARY_MAGIC, sizeof(BINARY_MAGIC));
+    store_le(header, BINARY_VERSION);
+    store_le(header, flags_);
+    file_.write(header.data(), static_cast<std::streamsize>(header.size()));
+    return !file_.fail();
+  }
+
+  bool FlushBlock()
+  {
+    auto word_count = static_cast<std::uint32_t>(offsets_.size() - 1);
+    if (word_count == 0)
+    {
+      return true;
+    }
+
+    payload_.clear();
+    for (auto offset : offsets_)
+    {
+      store_le(payload_, offset);
+    }
+    payload_.append(data_);
+    payload_.append((8 - payload_.size() % 8) % 8, '\0');
+    for (auto hash : hashes_)
+    {
+      store_le(payload_, hash);
+    }
+    for (auto count : counts_)
+    {
+      store_le(payload_, count);
+    }
+
+    std::string block_header;
+    store_le(block_header, word_count);
+    store_le(block_header, static_cast<std::uint32_t>(payload_.size()));
+    store_le(block_header, hash_bytes(payload_.data(), payload_.size()));
+    file_.write(block_header.data(), static_cast<std::streamsize>(block_header.size()));
+    file_.write(payload_.data(), static_cast<std::streamsize>(payload_.size()));
+
+    offsets_.assign(1, 0);
+    data_.clear();
+    hashes_.clear();
+    counts_.clear();
+    return !file_.fail();
+  }
+
+  std::ofstream file_;
+  std::uint16_t flags_;
+  std::vector<std::uint32_t> offsets_;
+  std::string data_;
+  std::vector<std::uint64_t> hashes_;
+  std::vector<std::uint32_t> counts_;
+  std::string payload_;
+};
+
+bool write_result_to_binary(const WordList &list, const std::vector<std::size_t> &order,
+                            const std::vector<std::uint32_t> &counts, const fs::path &output_path,
+                            const Options &options)
+{
+  TraceSpan span("write");
+  std::uint16_t flags = 0;
+  // Score order is not byte order, so a scored file must not pass for a sorted run.
+  flags |= options.sort && !options.sort_score ? kBinarySorted : 0;
+  flags |= options.deduplicate ? kBinaryDeduplicated : 0;
+  flags |= options.binary_hashes ? kBinaryHashes : 0;
+  flags |= options.binary_counts ? kBinaryCounts : 0;
+
+  auto output = BinaryOutputFile::Create(output_path, flags);
+  if (!output)
+  {
+    std::cerr << "Error: Failed to open output file: " << output_path << std::endl;
+    return false;
+  }
+
+  for (size_t i = 0; i < order.size(); ++i)
+  {
+    auto index = order[i];
+    std::uint64_t hash = list.hashed ? list.hashes[index] : hash_word(list.words[index]);
+    if (!output->Write(list.words[index], hash, counts.empty() ? 1 : counts[i]))
+    {
+      std::cerr << "Error: Failed to write to output file" << std::endl;
+      return false;
+    }
+  }
+
+  return output->Finish();
+}
+
+// Writes the output words once more, split by script into OUTPUT.SCRIPT, and records how many went to
+// each. Every output word is classified once, after the pipeline, sort and dedup of the main run, so
+// each file keeps the main output's order and counts. Scripts without words get no file.
+bool write_scripts(const WordList &list, const std::vector<std::size_t> &order, const std::vector<std::uint32_t> &counts,
+                   const fs::path &output_path, const Options &options, std::array<std::size_t, kScriptCount> &script_words)
+{
+  TraceSpan span("write scripts");
+  std::array<std::vector<std::size_t>, kScriptCount> orders;
+  std::array<std::vector<std::uint32_t>, kScriptCount> script_counts;
+  for (size_t i = 0; i < order.size(); ++i)
+  {
+    auto script = classify_script(list.words[order[i]]);
+    orders[script].push_back(order[i]);
+    if (!counts.empty())
+    {
+      script_counts[script].push_back(counts[i]);
+    }
+  }
+
+  for (size_t s = 0; s < kScriptCount; ++s)
+  {
+    if (orders[s].empty())
+    {
+      continue;
+    }
+    fs::path path = output_path.string() + "." + SCRIPT_NAMES[s];
+    bool written = options.binary_out ? write_result_to_binary(list, orders[s], script_counts[s], path, options)
+                                      : write_result_to_file(list, orders[s], path, options.junk_tag);
+    if (!written)
+    {
+      std::cerr << "Error: Failed to write output file: " << path << std::endl;
+      return false;
+    }
+    script_words[s] = orders[s].size();
+  }
+  return true;
+}
+
+inline bool same_word(const WordList &list, std::size_t a, std::size_t b)
+{
+  // Differing hashes settle most comparisons without touching the strings.
+  return (!list.hashed || list.hashes[a] == list.hashes[b]) && list.words[a] == list.words[b];
+}
+
+// True when two words are equal once every byte goes through `key_map`.
+bool same_key(std::string_view a, std::string_view b, const std::array<char, 256> &key_map)
+{
+  if (a.size() != b.size())
+  {
+    return false;
+  }
+  for (size_t i = 0; i < a.size(); ++i)
+  {
+    if (key_map[static_cast<unsigned char>(a[i])] != key_map[static_cast<unsigned char>(b[i])])
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Collapses adjacent duplicates in `order`, optionally recording how often each kept word occurred.
+// With a `key_map`, neighbours are duplicates when their mapped bytes match.
+void deduplicate_adjacent(const WordList &list, std::vector<std::size_t> &order, std::vector<std::uint32_t> *counts,
+                          const std::array<char, 256> *key_map = nullptr)
+{
+  TraceSpan span("dedup");
+  size_t out = 0;
+  for (size_t i = 0; i < order.size(); ++i)
   {
-    processed = strip_html_tags(processed);
+    if (out > 0 && (key_map ? same_key(list.words[order[i]], list.words[order[out - 1]], *key_map)
+                            : same_word(list, order[i], order[out - 1])))
+    {
+      if (counts)
+      {
+        (*counts)[out - 1] += word_weight(list, order[i]);
+      }
+      continue;
+    }
+    order[out] = order[i];
+    if (counts)
+    {
+      counts->push_back(word_weight(list, order[i]));
+    }
+    ++out;
   }
+  order.resize(out);
+}
+
+// Passes allocations through to `upstream` and counts them. Not thread-safe, like the standard pool
+// resources it is meant to sit under.
+class CountingResource : public std::pmr::memory_resource
+{
+public:
+  explicit CountingResource(std::pmr::memory_resource *upstream = std::pmr::new_delete_resource())
+      : upstream_(upstream) {}
+
+  std::uint64_t allocations() const { return allocations_; }
+  std::uint64_t bytes() const { return bytes_; }
 
-  if (options.lower)
+private:
+  void *do_allocate(std::size_t bytes, std::size_t alignment) override
   {
-    std::transform(processed.begin(), processed.end(), processed.begin(),
-                   [](unsigned char c)
-                   { return std::tolower(c); });
+    ++allocations_;
+    bytes_ += bytes;
+    return upstream_->allocate(bytes, alignment);
   }
 
-  if (options.digit_trim)
+  void do_deallocate(void *pointer, std::size_t bytes, std::size_t alignment) override
   {
-    processed = trim_digits(processed);
+    upstream_->deallocate(pointer, bytes, alignment);
   }
 
-  if (options.special_trim)
+  bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override { return this == &other; }
+
+  std::pmr::memory_resource *upstream_;
+  std::uint64_t allocations_ = 0;
+  std::uint64_t bytes_ = 0;
+};
+
+// Keeps the first occurrence of every word, using the hashes computed during processing. The table's
+// nodes come from an arena that is released in one go, instead of one heap allocation per word.
+// With a `key_map`, words collide when their mapped bytes match, and the first spelling is kept.
+void deduplicate_hashed(const WordList &list, std::vector<std::size_t> &order, std::vector<std::uint32_t> *counts,
+                        MemoryStats &memory, const std::array<char, 256> *key_map = nullptr)
+{
+  TraceSpan span("hash dedup");
+  std::vector<std::uint64_t> keys;
+  if (key_map)
   {
-    processed = trim_special(processed);
+    keys.resize(list.words.size());
+    std::string mapped;
+    for (auto index : order)
+    {
+      const auto &word = list.words[index];
+      mapped.resize(word.size());
+      for (size_t i = 0; i < word.size(); ++i)
+      {
+        mapped[i] = (*key_map)[static_cast<unsigned char>(word[i])];
+      }
+      keys[index] = hash_word(mapped);
+    }
   }
+  auto hash = [&list, &keys](std::size_t index)
+  { return static_cast<std::size_t>(keys.empty() ? list.hashes[index] : keys[index]); };
+  auto equal = [&list, key_map](std::size_t a, std::size_t b)
+  { return key_map ? same_key(list.words[a], list.words[b], *key_map) : same_word(list, a, b); };
+  CountingResource upstream;
+  std::pmr::monotonic_buffer_resource arena(&upstream);
+  std::pmr::unordered_map<std::size_t, std::size_t, decltype(hash), decltype(equal)> seen(order.size(), hash, equal,
+                                                                                          &arena);
 
-  if (options.detab)
+  size_t out = 0;
+  for (size_t i = 0; i < order.size(); ++i)
   {
-    size_t first_non_space = processed.find_first_not_of(" \t");
-    if (first_non_space != std::string::npos)
+    auto [it, inserted] = seen.try_emplace(order[i], out);
+    if (!inserted)
     {
-      processed = processed.substr(first_non_space);
+      if (counts)
+      {
+        (*counts)[it->second] += word_weight(list, order[i]);
+      }
+      continue;
     }
-    else
+    order[out] = order[i];
+    if (counts)
     {
-      processed.clear();
+      counts->push_back(word_weight(list, order[i]));
     }
+    ++out;
   }
+  order.resize(out);
+  memory.arena += upstream.bytes();
+  memory.arena_allocations += upstream.allocations();
+  memory.table_load = seen.load_factor();
+}
 
-  if (options.maxtrim > 0 && processed.length() > static_cast<size_t>(options.maxtrim))
+// Reorders the output by word_guesses, weakest first. Ties fall back to the position, so words with
+// the same score stay in sorted or input order. Occurrence counts move with their words.
+void order_by_score(const WordList &list, std::vector<std::size_t> &order, std::vector<std::uint32_t> *counts)
+{
+  TraceSpan span("score");
+  std::vector<std::pair<std::uint64_t, std::size_t>> scored(order.size());
+  for (size_t i = 0; i < order.size(); ++i)
   {
-    processed = processed.substr(0, options.maxtrim);
+    scored[i] = {word_guesses(list.words[order[i]]), i};
   }
+  std::sort(scored.begin(), scored.end());
 
-  if (options.dup_remove)
+  std::vector<std::size_t> sorted(order.size());
+  std::vector<std::uint32_t> sorted_counts(counts ? counts->size() : 0);
+  for (size_t i = 0; i < scored.size(); ++i)
   {
-    std::string deduped;
-    for (char c : processed)
+    sorted[i] = order[scored[i].second];
+    if (counts)
     {
-      if (deduped.empty() || c != deduped.back())
-      {
-        deduped += c;
-      }
+      sorted_counts[i] = (*counts)[scored[i].second];
     }
-    processed = deduped;
   }
-
-  if (options.no_numbers && std::all_of(processed.begin(), processed.end(), is_digit))
+  order = std::move(sorted);
+  if (counts)
   {
-    return "";
+    *counts = std::move(sorted_counts);
   }
+}
+
+// Returns the indices of the words to write, in output order.
+std::vector<std::size_t> arrange_words(const WordList &list, const Options &options, SortedRuns &runs,
+                                       std::vector<std::uint32_t> *counts, Stats &stats)
+{
+  std::vector<std::size_t> order(list.words.size());
+  std::iota(order.begin(), order.end(), 0);
+  // A single sorted run read in input order needs no sort at all.
+  bool presorted = runs.sorted && runs.ends.size() <= 1 && runs.order == order;
 
-  if (options.hash_remove && processed.length() >= 32)
+  // Leet-insensitive duplicates are not adjacent in sorted order, so they always go through the table.
+  if (options.deduplicate && options.sort && (options.hash_first || options.leet_dedup))
   {
-    bool is_hash = true;
-    for (char c : processed)
+    // Collapse duplicates first so the sort only sees distinct words; counts follow their words.
+    deduplicate_hashed(list, order, counts, stats.memory, options.leet_dedup ? &LEET_MAP : nullptr);
+    std::vector<std::uint32_t> count_by_index;
+    if (counts)
     {
-      if (!is_digit(c) && (c < 'a' || c > 'f') && (c < 'A' || c > 'F'))
+      count_by_index.resize(list.words.size());
+      for (size_t i = 0; i < order.size(); ++i)
       {
-        is_hash = false;
-        break;
+        count_by_index[order[i]] = (*counts)[i];
       }
     }
-    if (is_hash)
+    stats.sort_engine = presorted ? "presorted" : sort_adaptive(list, order, false, options.engine == "bitmap");
+    for (size_t i = 0; counts && i < order.size(); ++i)
     {
-      return "";
+      (*counts)[i] = count_by_index[order[i]];
+    }
+    if (options.sort_score)
+    {
+      order_by_score(list, order, counts);
     }
+    return order;
   }
 
-  if (options.dup_sense > 0)
+  if (options.sort && runs.sorted)
   {
-    std::unordered_map<char, int> char_count;
-    for (char c : processed)
-    {
-      char_count[c]++;
-    }
-    for (const auto &pair : char_count)
-    {
-      if (static_cast<double>(pair.second) / processed.length() > options.dup_sense / 100.0)
-      {
-        return "";
-      }
-    }
+    order = std::move(runs.order);
+    merge_runs(list, order, runs.ends);
+    stats.sort_engine = runs.ends.size() <= 1 ? runs.engine : "merge";
+  }
+  else if (options.sort)
+  {
+    stats.sort_engine = sort_adaptive(list, order, collapses_in_sort(options), options.engine == "bitmap");
+  }
+
+  // Without --sort only neighbouring repeats are duplicates, as they always were.
+  if (options.deduplicate)
+  {
+    deduplicate_adjacent(list, order, counts, options.leet_dedup ? &LEET_MAP : nullptr);
   }
 
-  if (options.email_sort && is_valid_email(processed))
+  if (options.sort_score)
   {
-    auto [username, domain] = split_email(processed);
-    return username + " " + domain;
+    order_by_score(list, order, counts);
   }
+  return order;
+}
 
-  return processed;
+// Sorts, deduplicates and writes an --also target, which has no provenance or stats of its own.
+bool write_target(Target &target)
+{
+  const auto &options = target.options;
+  std::vector<std::uint32_t> counts;
+  auto order = arrange_words(target.list, options, target.runs, options.binary_out && options.binary_counts ? &counts : nullptr,
+                             target.stats);
+  target.unique_words = order.size();
+  return options.binary_out ? write_result_to_binary(target.list, order, counts, target.output, options)
+                            : write_result_to_file(target.list, order, target.output, options.junk_tag);
 }
 
-[[nodiscard]] bool process_file(const fs::path &path, std::vector<std::string> &words,
-                                std::atomic<size_t> &total_words, const Options &options)
+// HyperLogLog distinct-count estimator over precomputed 64-bit word hashes.
+class HyperLogLog
 {
-  auto file = CompressedMemoryMappedFile::Create(path);
-  if (!file)
+public:
+  void Add(std::uint64_t hash)
   {
-    std::cerr << "Error: Failed to open file: " << path << std::endl;
-    return false;
+    auto index = static_cast<std::size_t>(hash >> (64 - PRECISION));
+    auto rank = static_cast<std::uint8_t>(std::countl_zero((hash << PRECISION) | (1ull << (PRECISION - 1))) + 1);
+    registers_[index] = std::max(registers_[index], rank);
   }
 
-  std::string_view file_content(file->data(), file->size());
+  double Estimate() const
+  {
+    constexpr double m = REGISTERS;
+    double sum = 0;
+    std::size_t zeros = 0;
+    for (auto rank : registers_)
+    {
+      sum += std::ldexp(1.0, -rank);
+      zeros += rank == 0;
+    }
+    double estimate = 0.7213 / (1 + 1.079 / m) * m * m / sum;
+    if (estimate <= 2.5 * m && zeros > 0)
+    {
+      estimate = m * std::log(m / static_cast<double>(zeros));
+    }
+    return estimate;
+  }
+
+private:
+  static constexpr int PRECISION = 12;
+  static constexpr std::size_t REGISTERS = 1 << PRECISION;
+  std::array<std::uint8_t, REGISTERS> registers_{};
+};
+
+// Above this sampled duplicate ratio, hashing out duplicates before sorting beats sorting everything.
+inline constexpr double HASH_FIRST_DUPLICATE_RATIO = 0.3;
+inline constexpr std::size_t PLAN_SAMPLE_WINDOWS = 16;
+inline constexpr std::size_t PLAN_WINDOW_BYTES = 64 * 1024;
+
+struct Plan
+{
+  std::size_t text_inputs = 0;
+  std::size_t binary_inputs = 0;
+  std::uintmax_t input_bytes = 0;
+  std::uintmax_t text_bytes = 0;
+  std::uintmax_t largest_input = 0;
+  std::uintmax_t sampled_bytes = 0;
+  std::size_t sampled_lines = 0;
+  std::size_t sampled_words = 0;
+  std::size_t binary_words = 0;
+  std::size_t binary_unique_words = 0; // words of binary inputs written with --deduplicate
+  std::vector<std::size_t> length_histogram;
+  double sample_distinct = 0;
+  double sample_seconds = 0;
+  double sort_sample_seconds = 0;
+  double est_words = 0;
+  double est_distinct = 0;
+  double est_memory = 0;
+  double est_seconds = 0;
+  std::string engine;
+  std::uint64_t keyspace = 0;
+  std::size_t threads = 1;
+};
 
-  while (!file_content.empty())
+// Adds one evenly spaced window of `path` to the plan and returns its words.
+void sample_window(std::ifstream &file, std::uintmax_t offset, const Options &options, Plan &plan,
+                   WordList &sample, HyperLogLog &distinct)
+{
+  std::string window(PLAN_WINDOW_BYTES, '\0');
+  file.clear();
+  file.seekg(static_cast<std::streamoff>(offset));
+  file.read(window.data(), static_cast<std::streamsize>(window.size()));
+  window.resize(static_cast<std::size_t>(file.gcount()));
+
+  std::string_view content(window);
+  if (offset > 0)
+  {
+    // Skip the partial line the window starts in.
+    auto first = content.find('\n');
+    content.remove_prefix(first == std::string_view::npos ? content.size() : first + 1);
+  }
+  auto last = content.rfind('\n');
+  content = content.substr(0, last == std::string_view::npos ? 0 : last + 1);
+  plan.sampled_bytes += content.size();
+
+  while (!content.empty())
   {
-    auto line_end = file_content.find('\n');
-    std::string_view line_view = file_content.substr(0, line_end);
+    auto line_end = content.find('\n');
+    ++plan.sampled_lines;
+    process_line(content.substr(0, line_end), options, [&](std::string processed, RejectReason reason, std::string_view)
+                 {
+                   if (reason != kRejectNone || length_reject(processed, options) != kRejectNone)
+                   {
+                     return;
+                   }
+                   auto length = std::min<std::size_t>(processed.size(), plan.length_histogram.size() - 1);
+                   ++plan.length_histogram[length];
+                   ++plan.sampled_words;
+                   sample.hashes.push_back(hash_word(processed));
+                   distinct.Add(sample.hashes.back());
+                   sample.words.push_back(std::move(processed)); });
+    content.remove_prefix(line_end + 1);
+  }
+}
+
+// Samples the inputs and picks how to deduplicate, estimating memory and time for the full run.
+// Without `estimate`, only the input sizes are read, which is all the thread count needs.
+Plan plan_run(const std::vector<fs::path> &paths, const Options &options, bool estimate)
+{
+  TraceSpan span("plan");
+  Plan plan;
+  plan.length_histogram.assign(65, 0);
+  plan.threads = options.threads;
+  std::uintmax_t largest_text_input = 0;
+  WordList sample;
+  sample.hashed = true;
+  HyperLogLog distinct;
 
-    std::string line_str(line_view);
-    if (options.dewebify)
+  auto sample_start = std::chrono::steady_clock::now();
+  for (const auto &path : paths)
+  {
+    std::error_code ec;
+    auto size = fs::file_size(path, ec);
+    if (ec)
     {
-      line_str = strip_html_tags(line_str);
-      if (options.noutf8)
-      {
-        line_str.erase(std::remove_if(line_str.begin(), line_str.end(),
-                                      [](unsigned char c)
-                                      { return c <= 127; }),
-                       line_str.end());
-      }
+      continue;
     }
+    plan.input_bytes += size;
+    plan.largest_input = std::max(plan.largest_input, size);
 
-    if (options.wordify)
+    std::ifstream file(path, std::ios::binary);
+    char magic[sizeof(BINARY_MAGIC)] = {};
+    file.read(magic, sizeof(magic));
+    if (file && std::memcmp(magic, BINARY_MAGIC, sizeof(magic)) == 0)
     {
-      std::istringstream iss{line_str};
-      std::string subword;
-      while (iss >> subword)
+      // Block headers give exact word counts without reading the payloads.
+      ++plan.binary_inputs;
+      char flags[sizeof(std::uint16_t)];
+      file.seekg(BINARY_HEADER_SIZE - sizeof(flags));
+      bool deduplicated = file.read(flags, sizeof(flags)) && (load_le<std::uint16_t>(flags) & kBinaryDeduplicated);
+      std::uintmax_t offset = BINARY_HEADER_SIZE;
+      char header[BINARY_BLOCK_HEADER_SIZE];
+      while (offset + BINARY_BLOCK_HEADER_SIZE <= size)
       {
-        std::string processed = process_word(subword, options);
-        if (!processed.empty() &&
-            (options.minlen == 0 || processed.length() >= static_cast<size_t>(options.minlen)) &&
-            (options.maxlen == 0 || processed.length() <= static_cast<size_t>(options.maxlen)))
+        file.seekg(static_cast<std::streamoff>(offset));
+        if (!file.read(header, sizeof(header)))
         {
-          words.push_back(processed);
-          total_words++;
+          break;
         }
+        plan.binary_words += load_le<std::uint32_t>(header);
+        plan.binary_unique_words += deduplicated ? load_le<std::uint32_t>(header) : 0;
+        offset += BINARY_BLOCK_HEADER_SIZE + load_le<std::uint32_t>(header + 4);
       }
+      continue;
     }
-    else
+
+    ++plan.text_inputs;
+    plan.text_bytes += size;
+    largest_text_input = std::max(largest_text_input, size);
+    std::uintmax_t windows = estimate ? std::min<std::uintmax_t>(PLAN_SAMPLE_WINDOWS, size / PLAN_WINDOW_BYTES + 1) : 0;
+    for (std::uintmax_t w = 0; w < windows; ++w)
     {
-      std::string processed = process_word(line_str, options);
-      if (!processed.empty() &&
-          (options.minlen == 0 || processed.length() >= static_cast<size_t>(options.minlen)) &&
-          (options.maxlen == 0 || processed.length() <= static_cast<size_t>(options.maxlen)))
-      {
-        words.push_back(processed);
-        total_words++;
-      }
+      sample_window(file, size / windows * w, options, plan, sample, distinct);
     }
+  }
+  plan.sample_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - sample_start).count();
 
-    if (line_end == std::string_view::npos)
+  if (plan.threads == 0)
+  {
+    // Only text inputs of MIN_SPLIT_BYTES per worker are split, so more threads than that would idle.
+    // A reservoir sample depends on how the input is split, so it stays on one worker.
+    auto cores = std::max(1u, std::thread::hardware_concurrency());
+    plan.threads = options.reservoir > 0 ? 1 : std::clamp<std::uintmax_t>(largest_text_input / MIN_SPLIT_BYTES, 1, cores);
+  }
+
+  std::vector<std::size_t> order(sample.words.size());
+  std::iota(order.begin(), order.end(), 0);
+  auto sort_start = std::chrono::steady_clock::now();
+  sort_order(sample, order);
+  plan.sort_sample_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - sort_start).count();
+
+  double scale = plan.sampled_bytes > 0 ? static_cast<double>(plan.text_bytes) / plan.sampled_bytes : 0;
+  plan.sample_distinct = plan.sampled_words > 0 ? std::min(distinct.Estimate(), static_cast<double>(plan.sampled_words)) : 0;
+  double distinct_ratio = plan.sampled_words > 0 ? plan.sample_distinct / plan.sampled_words : 1.0;
+  plan.est_words = plan.sampled_words * scale + static_cast<double>(plan.binary_words);
+  // Words of a deduplicated binary input are known to be distinct, as long as no transform merges them.
+  double unique_share = plan.est_words > 0 && !has_transforms(options) ? plan.binary_unique_words / plan.est_words : 0;
+  if (options.reservoir > 0)
+  {
+    plan.est_words = std::min(plan.est_words, static_cast<double>(options.reservoir));
+  }
+  plan.est_words *= options.sample;
+  plan.est_distinct = plan.est_words * (unique_share + (1.0 - unique_share) * distinct_ratio);
+
+  if (!options.deduplicate || !options.sort)
+  {
+    plan.engine = options.deduplicate ? "hash" : options.sort ? "sort" : "none";
+  }
+  else if (options.engine != "auto")
+  {
+    plan.engine = options.engine;
+  }
+  else
+  {
+    plan.engine = 1.0 - distinct_ratio > HASH_FIRST_DUPLICATE_RATIO ? "hash" : "sort";
+  }
+  if (options.sort && sample.words.size() > 0 && (options.engine == "auto" || options.engine == "bitmap"))
+  {
+    // The sample cannot prove the whole input fits the keyspace; the sort re-checks every word.
+    auto keyspace = find_keyspace(sample, order);
+    auto keys_per_word = options.engine == "bitmap" ? BITMAP_FORCED_KEYS_PER_WORD : BITMAP_KEYS_PER_WORD;
+    if (keyspace && keyspace->size / keys_per_word <= plan.est_words)
     {
-      break;
+      plan.engine = "bitmap";
+      plan.keyspace = keyspace->size;
     }
-    file_content.remove_prefix(line_end + 1);
   }
 
-  return true;
+  double average_length = 0;
+  for (size_t length = 0; length < plan.length_histogram.size(); ++length)
+  {
+    average_length += static_cast<double>(length * plan.length_histogram[length]);
+  }
+  average_length = plan.sampled_words > 0 ? average_length / plan.sampled_words : 0;
+  double heap_bytes = average_length >= 16 ? average_length + 1 : 0;
+  double per_word = sizeof(std::string) + heap_bytes + sizeof(std::size_t);
+  per_word += needs_hashes(options) ? sizeof(std::uint64_t) : 0;
+  per_word += options.provenance.empty() ? 0 : sizeof(std::uint64_t);
+  double sorted_words = plan.engine == "hash" ? plan.est_distinct : plan.est_words;
+  plan.est_memory = plan.est_words * per_word + static_cast<double>(plan.largest_input);
+  if (plan.keyspace > 0)
+  {
+    plan.est_memory += plan.est_words * sizeof(std::uint64_t) + plan.keyspace / 8 + plan.keyspace / 16;
+  }
+  else if (options.sort)
+  {
+    plan.est_memory += sorted_words * sizeof(SortRecord);
+  }
+  plan.est_memory += options.deduplicate && plan.engine == "hash" ? plan.est_words * 2 * sizeof(std::size_t) : 0;
+
+  plan.est_seconds = plan.sample_seconds * scale;
+  if (options.sort && sample.words.size() > 1 && sorted_words > 1)
+  {
+    // Scale the measured sample sort by n log n.
+    double n = static_cast<double>(sample.words.size());
+    plan.est_seconds += plan.sort_sample_seconds * (sorted_words * std::log2(sorted_words)) / (n * std::log2(n));
+  }
+  return plan;
 }
 
-bool process_multiple_files(const std::vector<fs::path> &paths, std::vector<std::string> &words, std::atomic<size_t> &total_words, const Options &options)
+void print_plan(const Plan &plan)
 {
-  for (const auto &path : paths)
+  auto percentile = [&plan](double fraction)
   {
-    if (!process_file(path, words, total_words, options))
+    auto target = static_cast<std::size_t>(fraction * static_cast<double>(plan.sampled_words));
+    std::size_t seen = 0;
+    for (size_t length = 0; length < plan.length_histogram.size(); ++length)
     {
-      return false;
+      seen += plan.length_histogram[length];
+      if (seen > target)
+      {
+        return length;
+      }
     }
+    return plan.length_histogram.size() - 1;
+  };
+
+  std::cout << "Plan:" << std::endl;
+  std::cout << "  inputs        " << plan.text_inputs << " text, " << plan.binary_inputs << " binary, "
+            << plan.input_bytes / 1024 << " KiB" << std::endl;
+  std::cout << "  sampled       " << plan.sampled_bytes / 1024 << " KiB, " << plan.sampled_lines << " lines, "
+            << plan.sampled_words << " kept words" << std::endl;
+  if (plan.sampled_words > 0)
+  {
+    std::cout << "  word length   p50 " << percentile(0.5) << ", p90 " << percentile(0.9) << ", p99 "
+              << percentile(0.99) << std::endl;
   }
-  return true;
+  std::cout << "  est. words    " << static_cast<std::uint64_t>(plan.est_words) << " kept, ~"
+            << static_cast<std::uint64_t>(plan.est_distinct) << " distinct" << std::endl;
+  std::cout << "  engine        " << plan.engine;
+  if (plan.keyspace > 0)
+  {
+    std::cout << " (" << plan.keyspace << " keys, " << plan.keyspace / (8 * 1024) << " KiB bitmap)";
+  }
+  std::cout << std::endl;
+  std::cout << "  threads       " << plan.threads << std::endl;
+  std::cout << "  est. memory   " << static_cast<std::uint64_t>(plan.est_memory / (1024 * 1024)) << " MiB" << std::endl;
+  std::cout << "  est. time     " << static_cast<std::uint64_t>(plan.est_seconds * 1000) << " ms" << std::endl;
 }
 
-class OutputFile
+// Fills in the word store size and the process's peak resident set size.
+void measure_memory(const WordList &list, MemoryStats &memory)
 {
-public:
-  static std::unique_ptr<OutputFile> Create(const fs::path &path)
+  const std::size_t inline_capacity = std::string().capacity();
+  memory.word_store = list.words.capacity() * sizeof(std::string) + list.hashes.capacity() * sizeof(std::uint64_t) +
+                      list.origins.capacity() * sizeof(std::uint64_t) + list.weights.capacity() * sizeof(std::uint32_t);
+  for (const auto &word : list.words)
   {
-    auto output = std::unique_ptr<OutputFile>(new OutputFile());
-    if (!output->Initialize(path))
+    if (word.capacity() > inline_capacity)
     {
-      return nullptr;
+      memory.word_store += word.capacity() + 1;
+      ++memory.word_allocations;
     }
-    return output;
-  }
-
-  bool Write(const std::string &str)
-  {
-    file_ << str << '\n';
-    return !file_.fail();
   }
 
-private:
-  OutputFile() = default;
-
-  bool Initialize(const fs::path &path)
+  rusage usage{};
+  if (getrusage(RUSAGE_SELF, &usage) == 0)
   {
-    file_.open(path);
-    return file_.is_open();
+#ifdef __APPLE__
+    memory.peak_rss = static_cast<std::uint64_t>(usage.ru_maxrss);
+#else
+    memory.peak_rss = static_cast<std::uint64_t>(usage.ru_maxrss) * 1024;
+#endif
   }
+}
 
-  std::ofstream file_;
-};
-
-bool write_result_to_file(const std::vector<std::string> &words, const fs::path &output_path)
+bool write_stats(const Stats &stats, std::size_t total_words, std::size_t unique_words,
+                 std::chrono::milliseconds duration, const fs::path &stats_path)
 {
-  auto output = OutputFile::Create(output_path);
-  if (!output)
+  std::ofstream file(stats_path);
+  if (!file)
   {
-    std::cerr << "Error: Failed to open output file: " << output_path << std::endl;
+    std::cerr << "Error: Failed to open stats file: " << stats_path << std::endl;
     return false;
   }
 
-  for (const auto &word : words)
+  file << "{\n";
+  file << "  \"total_words\": " << total_words << ",\n";
+  file << "  \"unique_words\": " << unique_words << ",\n";
+  file << "  \"duration_ms\": " << duration.count() << ",\n";
+  file << "  \"bytes_read\": " << stats.bytes_read << ",\n";
+  file << "  \"lines\": " << stats.lines << ",\n";
+  file << "  \"prefiltered_lines\": " << stats.prefiltered << ",\n";
+  file << "  \"sort_engine\": \"" << stats.sort_engine << "\",\n";
+  file << "  \"rejected\": {";
+  for (size_t i = kRejectNone + 1; i < stats.rejected.size(); ++i)
+  {
+    file << (i > kRejectNone + 1 ? ", " : "") << "\"" << REJECT_NAMES[i] << "\": " << stats.rejected[i];
+  }
+  file << "},\n";
+  file << "  \"memory\": {\"peak_rss_bytes\": " << stats.memory.peak_rss
+       << ", \"word_store_bytes\": " << stats.memory.word_store
+       << ", \"word_heap_allocations\": " << stats.memory.word_allocations
+       << ", \"hash_arena_bytes\": " << stats.memory.arena
+       << ", \"hash_arena_allocations\": " << stats.memory.arena_allocations
+       << ", \"hash_table_load\": " << stats.memory.table_load << "},\n";
+  if (stats.perf_stages)
   {
-    if (!output->Write(word))
+    file << "  \"perf_counters\": ";
+    if (stats.perf_stages->empty())
     {
-      std::cerr << "Error: Failed to write to output file" << std::endl;
-      return false;
+      file << "null,\n";
+    }
+    else
+    {
+      file << "{\n";
+      for (size_t s = 0; s < stats.perf_stages->size(); ++s)
+      {
+        const auto &stage = (*stats.perf_stages)[s];
+        file << "    \"" << stage.stage << "\": {";
+        for (size_t i = 0; i < stage.values.size(); ++i)
+        {
+          file << (i > 0 ? ", " : "") << "\"" << PERF_EVENT_NAMES[i] << "\": ";
+          if (stage.values[i] < 0)
+          {
+            file << "null";
+          }
+          else
+          {
+            file << stage.values[i];
+          }
+        }
+        file << "}" << (s + 1 < stats.perf_stages->size() ? "," : "") << "\n";
+      }
+      file << "  },\n";
     }
   }
-
-  return true;
+  file << "  \"line_length_histogram\": [";
+  for (size_t i = 0; i < stats.line_lengths.size(); ++i)
+  {
+    file << (i > 0 ? ", " : "") << stats.line_lengths[i];
+  }
+  file << "]\n";
+  file << "}\n";
+  return !file.fail();
 }
 
 void print_header()
@@ -499,6 +4185,8 @@ int main(int argc, char *argv[])
   Options options{};
   fs::path output_path;
   std::vector<fs::path> input_paths;
+  std::vector<std::string> also_specs;
+  bool split_scripts = false;
 
   app.add_option("output", output_path, "Output file path")->required();
   app.add_option("input", input_paths, "Input file paths")->required()->expected(-1);
@@ -507,22 +4195,56 @@ int main(int argc, char *argv[])
   app.add_option("--maxtrim", options.maxtrim, "Trim words over a certain max length");
   app.add_flag("--digit-trim", options.digit_trim, "Trim all digits from beginning and end of words");
   app.add_flag("--special-trim", options.special_trim, "Trim all special characters from beginning and end of words");
+  app.add_option("--trim-chars", options.trim_chars, "Trim these characters (UTF-8 allowed) from beginning and end of words");
+  app.add_option("--ltrim", options.ltrim_chars, "Trim these characters (UTF-8 allowed) from the beginning of words");
+  app.add_option("--rtrim", options.rtrim_chars, "Trim these characters (UTF-8 allowed) from the end of words");
   app.add_flag("--dup-remove", options.dup_remove, "Remove duplicate characters within words");
   app.add_flag("--no-sentence", options.no_sentence, "Remove all spaces between words");
   app.add_flag("--lower", options.lower, "Change word to all lower case");
+  app.add_flag("--unleet", options.unleet, "Map leet spellings back to letters (4 @ -> a, 3 -> e, 1 -> i, 0 -> o, 5 $ -> s, 7 -> t)");
+  app.add_flag("--leet-dedup", options.leet_dedup, "Treat words that differ only in leet spellings as duplicates, keeping the first");
+  app.add_option("--leet-variants", options.leet_variants, "Also keep up to N leet spellings of every kept word");
   app.add_flag("--wordify", options.wordify, "Convert all input sentences into separate words");
   app.add_flag("--no-numbers", options.no_numbers, "Ignore/delete words that are all numeric");
   app.add_option("--minlen", options.minlen, "Filter out words below a certain min length");
   app.add_flag("--detab", options.detab, "Remove tabs or space from beginning of words");
   app.add_option("--dup-sense", options.dup_sense, "Remove word if more than <specified>% of characters are duplicates");
   app.add_flag("--hash-remove", options.hash_remove, "Filter out word candidates that are actually hashes");
+  app.add_flag("--junk-remove", options.junk_remove, "Filter out repetitions, runs and keyboard walks (aaaaaa, 123123, abcdef, asdfgh)");
+  app.add_flag("--junk-tag", options.junk_tag, "Append a tab and the junk kind (repeat, run or walk) to junk words in text output");
   app.add_flag("--email-sort", options.email_sort, "Convert email addresses to username and domain as separate words");
   app.add_option("--email-split", options.email_split, "Extract email addresses to username and domain wordlists (format: user:domain)")
       ->expected(1);
   app.add_flag("--dewebify", options.dewebify, "Extract words from HTML input");
   app.add_flag("--noutf8", options.noutf8, "Only output non UTF-8 characters (works with --dewebify only)");
+  app.add_option("--pipeline", options.pipeline_spec, "Apply word stages in this order instead of the transform flags, e.g. \"lower|trim:special|maxtrim:16|filter:hash\"");
   app.add_flag("--sort", options.sort, "Sort the output words");
+  app.add_flag("--sort-score", options.sort_score, "Order the output by estimated guesses, weakest first");
+  app.add_option("--min-entropy", options.min_entropy, "Filter out words below this Shannon entropy, in bits per byte");
+  app.add_option("--min-classes", options.min_classes, "Filter out words using fewer of lower, upper, digit and other characters");
   app.add_flag("--deduplicate", options.deduplicate, "Remove duplicate words from the output");
+  app.add_option("--sample", options.sample, "Keep a deterministic hash-based fraction of words (0 < RATE <= 1)")
+      ->check(CLI::Range(0.0, 1.0));
+  app.add_option("--reservoir", options.reservoir, "Keep a uniform random sample of N words");
+  app.add_option("--threads", options.threads, "Worker threads for reading large inputs (0 = all cores, default: picked from the input size)");
+  app.add_option("--engine", options.engine, "Deduplication engine for --sort --deduplicate: auto, sort, hash or bitmap")
+      ->check(CLI::IsMember({"auto", "sort", "hash", "bitmap"}));
+  app.add_flag("--explain", options.explain, "Print the execution plan and exit without processing");
+  app.add_option("--stats", options.stats, "Write run statistics as JSON to this file");
+  app.add_option("--trace", options.trace, "Write a Chrome trace of per-thread pipeline spans to this file");
+  app.add_option("--metrics-file", options.metrics_file, "Keep a Prometheus textfile-collector file of run metrics up to date");
+  app.add_option("--metrics-interval", options.metrics_interval, "Seconds between --metrics-file rewrites")
+      ->check(CLI::PositiveNumber);
+  app.add_option("--reject-log", options.reject_log_path, "Write dropped words with their reason to this file");
+  app.add_option("--reject-sample", options.reject_sample, "Log only one in every N dropped words")
+      ->check(CLI::PositiveNumber);
+  app.add_flag("--perf-counters", options.perf_counters, "Measure cycles, instructions, LLC and branch misses per stage");
+  app.add_option("--provenance", options.provenance, "Also write word, file id and line offset of each output word's first occurrence");
+  app.add_option("--also", also_specs, "Also write PATH[:key=value,...] from the same read, with its own filters (repeatable)");
+  app.add_flag("--split-scripts", split_scripts, "Also write the words of each script (latin, cyrillic, cjk, ...) to OUTPUT.SCRIPT");
+  app.add_flag("--binary-out", options.binary_out, "Write output in the binary block format for chained runs");
+  app.add_flag("--binary-hashes", options.binary_hashes, "Include a per-word hash column in binary output");
+  app.add_flag("--binary-counts", options.binary_counts, "Include per-word occurrence counts in binary output (with --deduplicate)");
 
   CLI11_PARSE(app, argc, argv);
 
@@ -541,41 +4263,275 @@ int main(int argc, char *argv[])
     }
   }
 
+  if (options.binary_counts && !options.deduplicate)
+  {
+    std::cerr << "Error: --binary-counts requires --deduplicate" << std::endl;
+    return 1;
+  }
+  if (options.leet_dedup && !options.deduplicate)
+  {
+    std::cerr << "Error: --leet-dedup requires --deduplicate" << std::endl;
+    return 1;
+  }
+
+  if (!options.provenance.empty() && input_paths.size() > MAX_ORIGIN_FILES)
+  {
+    std::cerr << "Error: --provenance supports at most " << MAX_ORIGIN_FILES << " input files" << std::endl;
+    return 1;
+  }
+
+  if (options.sample <= 0.0)
+  {
+    std::cerr << "Error: --sample must be greater than 0" << std::endl;
+    return 1;
+  }
+  if (options.sample < 1.0)
+  {
+    options.sample_threshold = static_cast<std::uint64_t>(std::ldexp(options.sample, 64));
+  }
+
+  options.left_trim = make_trim_set(options.trim_chars + options.ltrim_chars);
+  options.right_trim = make_trim_set(options.trim_chars + options.rtrim_chars);
+  if (!compile_pipeline(options))
+  {
+    return 1;
+  }
+  if (!options.pipeline_spec.empty())
+  {
+    // Stage flags only build the pipeline from flags. Options that parameterize a stage still need it in the spec.
+    struct StageOption
+    {
+      const char *name;
+      PipelineStage::Function stage; // nullptr when the option only switches a stage on
+    };
+    const std::array<StageOption, 17> stage_options = {{
+        {"--maxtrim", nullptr},
+        {"--digit-trim", nullptr},
+        {"--special-trim", nullptr},
+        {"--dup-remove", nullptr},
+        {"--lower", nullptr},
+        {"--unleet", nullptr},
+        {"--no-numbers", nullptr},
+        {"--detab", nullptr},
+        {"--dup-sense", nullptr},
+        {"--hash-remove", nullptr},
+        {"--junk-remove", nullptr},
+        {"--email-sort", nullptr},
+        {"--trim-chars", stage_trim_chars},
+        {"--ltrim", stage_trim_chars},
+        {"--rtrim", stage_trim_chars},
+        {"--min-entropy", stage_filter_entropy},
+        {"--min-classes", stage_filter_classes},
+    }};
+    for (const auto &option : stage_options)
+    {
+      bool used = option.stage && std::any_of(options.pipeline.begin(), options.pipeline.end(), [&](const PipelineStage &stage)
+                                              { return stage.run == option.stage; });
+      if (app.count(option.name) > 0 && !used)
+      {
+        std::cerr << "Error: '" << option.name << "' has no effect with --pipeline; "
+                  << (option.stage ? "add its stage to the pipeline" : "use its stage in the pipeline instead") << std::endl;
+        return 1;
+      }
+    }
+  }
+
   std::cout << PROGRAM_NAME << " version " << PROGRAM_VERSION << " (" << BUILD_DATE << " " << BUILD_TIME << " " << BUILD_PLATFORM << ")" << std::endl;
   std::cout << PROGRAM_COPYRIGHT << std::endl;
   std::cout << std::endl;
 
+  if (app.count("--threads") > 0 && options.threads == 0)
+  {
+    options.threads = std::max(1u, std::thread::hardware_concurrency());
+  }
+
+  if (!options.trace.empty())
+  {
+    Trace::Start();
+  }
+
+  std::unique_ptr<RejectLog> reject_log;
+  if (!options.reject_log_path.empty())
+  {
+    reject_log = RejectLog::Create(options.reject_log_path);
+    if (!reject_log)
+    {
+      return 1;
+    }
+    options.reject_log = reject_log.get();
+  }
+
+  std::unique_ptr<MetricsWriter> metrics;
+  if (!options.metrics_file.empty())
+  {
+    Metrics::SetFiles(input_paths.size());
+    Metrics::SetPhase(Metrics::kPhasePlan);
+    auto interval = std::chrono::duration<double>(options.metrics_interval);
+    metrics = MetricsWriter::Create(options.metrics_file, std::chrono::duration_cast<std::chrono::milliseconds>(interval));
+    if (!metrics)
+    {
+      return 1;
+    }
+  }
+
+  bool estimate = options.explain || (options.engine == "auto" && options.sort && options.deduplicate);
+  options.hash_first = options.engine == "hash";
+  if (estimate || options.threads == 0)
+  {
+    auto plan = plan_run(input_paths, options, estimate);
+    if (options.explain)
+    {
+      print_plan(plan);
+      return 0;
+    }
+    options.threads = plan.threads;
+    options.hash_first = estimate ? plan.engine == "hash" : options.hash_first;
+  }
+
+  std::vector<Target> targets(1);
+  targets.front().options = options;
+  targets.front().output = output_path;
+  for (const auto &spec : also_specs)
+  {
+    if (!parse_target(spec, options, targets.emplace_back()))
+    {
+      return 1;
+    }
+  }
+
   auto start = std::chrono::high_resolution_clock::now();
 
   std::atomic<size_t> total_words(0);
-  std::vector<std::string> words;
+  auto &list = targets.front().list;
+  auto &runs = targets.front().runs;
+  auto &stats = targets.front().stats;
 
-  if (!process_multiple_files(input_paths, words, total_words, options))
+  std::unique_ptr<PerfCounters> perf_counters;
+  if (options.perf_counters)
   {
-    return 1;
+    perf_counters = PerfCounters::Create();
+    stats.perf_stages.emplace();
+    if (!perf_counters)
+    {
+      std::cerr << "Warning: Hardware performance counters are not available, --perf-counters has no effect" << std::endl;
+    }
   }
+  auto end_stage = [&](const char *stage)
+  {
+    if (perf_counters)
+    {
+      stats.perf_stages->push_back(perf_counters->Lap(stage));
+    }
+  };
 
-  if (options.sort)
+  Metrics::SetPhase(Metrics::kPhaseRead);
+  if (!process_multiple_files(input_paths, targets, total_words))
   {
-    std::sort(words.begin(), words.end());
+    return 1;
+  }
+  if (reject_log && !reject_log->Close())
+  {
+    std::cerr << "Error: Failed to write reject log: " << options.reject_log_path << std::endl;
+    return 1;
   }
+  end_stage("ingest");
 
-  if (options.deduplicate)
+  // The other targets are sorted and written alongside the main output.
+  std::vector<std::thread> also_workers;
+  std::vector<char> also_written(targets.size(), 0);
+  for (size_t t = 1; t < targets.size(); ++t)
   {
-    auto last = std::unique(words.begin(), words.end());
-    words.erase(last, words.end());
+    also_workers.emplace_back([&targets, &also_written, t]
+                              { also_written[t] = write_target(targets[t]); });
   }
 
-  if (!write_result_to_file(words, output_path))
+  Metrics::SetPhase(Metrics::kPhaseSort);
+  std::vector<std::uint32_t> counts;
+  auto order = arrange_words(list, options, runs, options.binary_out && options.binary_counts ? &counts : nullptr, stats);
+  end_stage("sort");
+
+  Metrics::SetPhase(Metrics::kPhaseWrite);
+  bool written = options.binary_out ? write_result_to_binary(list, order, counts, output_path, options)
+                                    : write_result_to_file(list, order, output_path, options.junk_tag);
+  bool provenance_written = written && (options.provenance.empty() || write_provenance(list, order, input_paths, options.provenance));
+  std::array<std::size_t, kScriptCount> script_words{};
+  bool scripts_written = written && (!split_scripts || write_scripts(list, order, counts, output_path, options, script_words));
+  for (auto &worker : also_workers)
+  {
+    worker.join();
+  }
+  if (!written)
   {
     std::cerr << "Error: Failed to write output file" << std::endl;
     return 1;
   }
+  if (!provenance_written || !scripts_written)
+  {
+    return 1;
+  }
+  for (size_t t = 1; t < targets.size(); ++t)
+  {
+    if (!also_written[t])
+    {
+      std::cerr << "Error: Failed to write output file: " << targets[t].output << std::endl;
+      return 1;
+    }
+  }
+  end_stage("write");
+  Metrics::SetWordsOut(order.size());
+  Metrics::SetPhase(Metrics::kPhaseDone);
 
   auto end = std::chrono::high_resolution_clock::now();
   auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(end - start);
 
-  std::cout << "Processed " << total_words << " total words (" << words.size() << " unique) in " << duration.count() << " ms" << std::endl;
+  measure_memory(list, stats.memory);
+  auto mib = [](std::uint64_t bytes)
+  { return (bytes + (1 << 19)) >> 20; };
+
+  std::cout << "Processed " << total_words << " total words (" << order.size() << " unique) in " << duration.count() << " ms" << std::endl;
+  for (size_t s = 0; s < kScriptCount; ++s)
+  {
+    if (script_words[s] > 0)
+    {
+      std::cout << "Also wrote " << script_words[s] << " " << SCRIPT_NAMES[s] << " words to " << output_path.string() << "."
+                << SCRIPT_NAMES[s] << std::endl;
+    }
+  }
+  for (size_t t = 1; t < targets.size(); ++t)
+  {
+    std::cout << "Also wrote " << targets[t].total_words << " total words (" << targets[t].unique_words << " unique) to "
+              << targets[t].output.string() << std::endl;
+  }
+  std::cout << "Memory: peak RSS " << mib(stats.memory.peak_rss) << " MiB, word store " << mib(stats.memory.word_store)
+            << " MiB (" << stats.memory.word_allocations << " heap words)";
+  if (stats.memory.arena > 0)
+  {
+    std::cout << ", hash arena " << mib(stats.memory.arena) << " MiB at load " << stats.memory.table_load;
+  }
+  std::cout << std::endl;
+  for (size_t s = 0; stats.perf_stages && s < stats.perf_stages->size(); ++s)
+  {
+    const auto &stage = (*stats.perf_stages)[s];
+    std::cout << "  " << stage.stage << ":";
+    for (size_t i = 0; i < stage.values.size(); ++i)
+    {
+      if (stage.values[i] >= 0)
+      {
+        std::cout << " " << stage.values[i] << " " << PERF_EVENT_NAMES[i];
+      }
+    }
+    std::cout << std::endl;
+  }
+
+  if (!options.stats.empty() && !write_stats(stats, total_words, order.size(), duration, options.stats))
+  {
+    return 1;
+  }
+
+  if (!options.trace.empty() && !Trace::Write(options.trace))
+  {
+    return 1;
+  }
 
   return 0;
 }